@@ -1,12 +1,20 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
 #include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include "ext2.h"
 
+#define GROUP_DESC_CHUNK		(64 << 10) /* Bytes of group desc table per pread */
+
 /******************* 
  * Command that I used to create ext2:
  * sudo mke2fs -b 1024 -d ./ext2/ -O ^sparse_super  -O ^resize_inode -O ^large_file -O ^filetype -O ^ext_attr -O ^dir_index -e panic -I 128 -t ext2 -c -c -L ext2_fs -r 0 /dev/sdc15 15m
@@ -14,13 +22,136 @@
  * sample_dir contains a lot dirs with files containing "test" and very_large_file that uses indirect blocks
  ******************/
 
-static int read_super_block(int fd, struct ext2_super_block *sb) {
-	struct ext2_super_block sb_on_disk;
-	int res = pread(fd, &sb_on_disk, sizeof(sb_on_disk), BOOT_LOADER_SPACE);
-	if (res != sizeof(sb_on_disk)) {
-		errno = ERR_FS_IO; // Error reading fs
+/*** pread backend ***/
+
+static int pread_open(struct ext2 *ext2) {
+	ext2->map = NULL;
+	return 0;
+}
+
+static void pread_close(const struct ext2 *ext2) {
+	(void)ext2;
+}
+
+static int pread_read(const struct ext2 *ext2, void *buf, size_t len, u64 offset) {
+	EXT2_STATS_SYSCALL(ext2);
+	if (pread(ext2->fd, buf, len, offset) != (ssize_t)len) {
+		errno = ERR_FS_IO;
+		return -1;
+	}
+	return 0;
+}
+
+static const u8 *pread_map(const struct ext2 *ext2, u64 offset, size_t len) {
+	(void)ext2, (void)offset, (void)len;
+	return NULL;
+}
+
+static void pread_advise(const struct ext2 *ext2, u64 offset, u64 len, int advice) {
+	static const int fadvice[] = {
+		[EXT2_ADVICE_NORMAL] = POSIX_FADV_NORMAL,
+		[EXT2_ADVICE_SEQUENTIAL] = POSIX_FADV_SEQUENTIAL,
+		[EXT2_ADVICE_RANDOM] = POSIX_FADV_RANDOM,
+		[EXT2_ADVICE_WILLNEED] = POSIX_FADV_WILLNEED,
+	};
+	EXT2_STATS_SYSCALL(ext2);
+	posix_fadvise(ext2->fd, offset, len, fadvice[advice]);
+}
+
+static const struct ext2_io_ops pread_ops = {
+	.open = pread_open,
+	.close = pread_close,
+	.read = pread_read,
+	.map = pread_map,
+	.advise = pread_advise,
+};
+
+/*** mmap backend ***/
+
+static int mmap_open(struct ext2 *ext2) {
+	ext2->map = mmap(NULL, ext2->image_size, PROT_READ, MAP_SHARED, ext2->fd, 0);
+	if (ext2->map == MAP_FAILED) {
+		ext2->map = NULL;
 		return -1;
 	}
+	return 0;
+}
+
+static void mmap_close(const struct ext2 *ext2) {
+	if (ext2->map)
+		munmap(ext2->map, ext2->image_size);
+}
+
+static const u8 *mmap_map(const struct ext2 *ext2, u64 offset, size_t len) {
+	if (offset > ext2->image_size || len > ext2->image_size - offset) {
+		errno = ERR_FS_IO;
+		return NULL;
+	}
+	return ext2->map + offset;
+}
+
+static int mmap_read(const struct ext2 *ext2, void *buf, size_t len, u64 offset) {
+	const u8 *data = mmap_map(ext2, offset, len);
+	if (!data)
+		return -1;
+	memcpy(buf, data, len);
+	return 0;
+}
+
+static void mmap_advise(const struct ext2 *ext2, u64 offset, u64 len, int advice) {
+	static const int madvice[] = {
+		[EXT2_ADVICE_NORMAL] = MADV_NORMAL,
+		[EXT2_ADVICE_SEQUENTIAL] = MADV_SEQUENTIAL,
+		[EXT2_ADVICE_RANDOM] = MADV_RANDOM,
+		[EXT2_ADVICE_WILLNEED] = MADV_WILLNEED,
+	};
+	/*** madvise wants page aligned address ***/
+	u64 page = sysconf(_SC_PAGESIZE);
+	u64 start = offset & ~(page - 1);
+	if (start >= ext2->image_size)
+		return;
+	len += offset - start;
+	if (len > ext2->image_size - start)
+		len = ext2->image_size - start;
+	EXT2_STATS_SYSCALL(ext2);
+	madvise(ext2->map + start, len, madvice[advice]);
+}
+
+static const struct ext2_io_ops mmap_ops = {
+	.open = mmap_open,
+	.close = mmap_close,
+	.read = mmap_read,
+	.map = mmap_map,
+	.advise = mmap_advise,
+};
+
+int ext2_io_read(const struct ext2 *ext2, void *buf, size_t len, u64 offset) {
+	EXT2_STATS_START(start);
+	int res = ext2->io->read(ext2, buf, len, offset);
+	if (!res)
+		EXT2_STATS_RECORD(ext2, EXT2_STAT_IO_READ, start, len);
+	return res;
+}
+
+void ext2_io_advise(const struct ext2 *ext2, u64 offset, u64 len, int advice) {
+	ext2->io->advise(ext2, offset, len, advice);
+}
+
+static const void *io_get(const struct ext2 *ext2, void *buf, size_t len, u64 offset) {
+	/*** Pointer into mapped image or buf filled by read ***/
+	if (ext2->map)
+		return ext2->io->map(ext2, offset, len);
+	if (ext2_io_read(ext2, buf, len, offset))
+		return NULL;
+	return buf;
+}
+
+static int read_super_block(const struct ext2 *ext2, struct ext2_super_block *sb) {
+	struct ext2_super_block sb_buf;
+	const struct ext2_super_block *sb_on_disk_p = io_get(ext2, &sb_buf, sizeof(sb_buf), BOOT_LOADER_SPACE);
+	if (!sb_on_disk_p)
+		return -1; // Error reading fs
+	const struct ext2_super_block sb_on_disk = *sb_on_disk_p;
 	sb->s_inodes_count = le32toh(sb_on_disk.s_inodes_count);
 	sb->s_blocks_count = le32toh(sb_on_disk.s_blocks_count);
 	sb->s_r_blocks_count = le32toh(sb_on_disk.s_r_blocks_count);
@@ -48,6 +179,7 @@ static int read_super_block(int fd, struct ext2_super_block *sb) {
 	sb->s_def_resgid = le16toh(sb_on_disk.s_def_resgid);
 	//// EXT2_DYNAMIC_REV
 	sb->s_first_ino = le32toh(sb_on_disk.s_first_ino);
+	sb->s_reserved_gdt_blocks = le16toh(sb_on_disk.s_reserved_gdt_blocks);
 	sb->s_inode_size = le16toh(sb_on_disk.s_inode_size);
 	sb->s_block_group_nr = le16toh(sb_on_disk.s_block_group_nr);
 	sb->s_feature_compat = le32toh(sb_on_disk.s_feature_compat);
@@ -56,59 +188,89 @@ static int read_super_block(int fd, struct ext2_super_block *sb) {
 	//strncpy(sb->s_uuid, sb_on_disk.s_uuid, 16);
 	strncpy(sb->s_volume_name, sb_on_disk.s_volume_name, 16);
 	strncpy(sb->s_last_mounted, sb_on_disk.s_last_mounted, 64);
+	for (int i = 0; i < 4; ++i)
+		sb->s_hash_seed[i] = le32toh(sb_on_disk.s_hash_seed[i]);
+	sb->s_def_hash_version = sb_on_disk.s_def_hash_version;
+	sb->s_flags = le32toh(sb_on_disk.s_flags);
 	// TODO
 	if (sb->s_magic != 61267) {
 		errno = ERR_FS_NOT_EXT2;
 		return -1;
 	}
-	if (sb->s_feature_incompat != 0) {
+	/*** Read-only, so unknown ro_compat features don't matter ***/
+	if (sb->s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_SUPP) {
 		errno = ERR_FS_INCOMPAT;
 		return -1;
 	}
+	if (sb->s_log_block_size > EXT2_MAX_BLOCK_LOG_SIZE) {
+		errno = ERR_FS_NOT_EXT2;
+		return -1;
+	}
 	return 0;
 }
 
-static int read_group_desc(int fd, struct ext2_group_desc *gd, u32 blocksize, u32 blocks_per_group, u32 blockgroup_no) {
-	struct ext2_group_desc gd_on_disk;
-	u32 block_group_offset = blockgroup_no * blocks_per_group * blocksize;
-	u32 offset = BOOT_LOADER_SPACE + block_group_offset + sizeof(struct ext2_super_block);
-	int res = pread(fd, &gd_on_disk, sizeof(gd_on_disk), offset);
-	if (res != sizeof(gd_on_disk)) {
-		errno = ERR_FS_IO;
+static int read_group_desc_table(struct ext2 *ext2) {
+	/*** Read the whole table with big preads and decode it into arrays ***/
+	struct ext2_groups *groups = &ext2->groups;
+	u32 count = ext2->groups_count;
+	u8 *mem = malloc((size_t)count * (3 * sizeof(u32) + 3 * sizeof(u16)));
+	if (!mem)
+		return -1;
+	groups->block_bitmap = (u32 *)mem;
+	groups->inode_bitmap = groups->block_bitmap + count;
+	groups->inode_table = groups->inode_bitmap + count;
+	groups->free_blocks_count = (u16 *)(groups->inode_table + count);
+	groups->free_inodes_count = groups->free_blocks_count + count;
+	groups->used_dirs_count = groups->free_inodes_count + count;
+	u32 chunk = GROUP_DESC_CHUNK / sizeof(struct ext2_group_desc);
+	struct ext2_group_desc *gd_buf = malloc(chunk * sizeof(struct ext2_group_desc));
+	if (!gd_buf)
 		return -1;
+	u64 offset = (u64)(ext2->first_data_block + 1) * ext2->blocksize;
+	for (u32 first = 0; first < count; first += chunk) {
+		u32 n = count - first < chunk ? count - first : chunk;
+		size_t len = n * sizeof(struct ext2_group_desc);
+		const struct ext2_group_desc *gd_on_disk = io_get(ext2, gd_buf, len, offset);
+		if (!gd_on_disk) {
+			free(gd_buf);
+			return -1;
+		}
+		for (u32 i = 0; i < n; ++i) {
+			groups->block_bitmap[first + i] = le32toh(gd_on_disk[i].bg_block_bitmap);
+			groups->inode_bitmap[first + i] = le32toh(gd_on_disk[i].bg_inode_bitmap);
+			groups->inode_table[first + i] = le32toh(gd_on_disk[i].bg_inode_table);
+			groups->free_blocks_count[first + i] = le16toh(gd_on_disk[i].bg_free_blocks_count);
+			groups->free_inodes_count[first + i] = le16toh(gd_on_disk[i].bg_free_inodes_count);
+			groups->used_dirs_count[first + i] = le16toh(gd_on_disk[i].bg_used_dirs_count);
+		}
+		offset += len;
 	}
-	gd->bg_block_bitmap = le32toh(gd_on_disk.bg_block_bitmap);
-	gd->bg_inode_bitmap = le32toh(gd_on_disk.bg_inode_bitmap);
-	gd->bg_inode_table = le32toh(gd_on_disk.bg_inode_table);
-	gd->bg_free_blocks_count = le16toh(gd_on_disk.bg_free_blocks_count);
-	gd->bg_free_inodes_count = le16toh(gd_on_disk.bg_free_inodes_count);
-	gd->bg_used_dirs_count = le16toh(gd_on_disk.bg_used_dirs_count);
+	free(gd_buf);
 	return 0;
 }
 
-static int get_inode_table_by_inode_number(const struct ext2 *ext2, u32 inode_number) {
-	int res;
-	struct ext2_group_desc gd;
-	u32 blockgroup_no = inode_number / ext2->inodes_per_group;
-	res = read_group_desc(ext2->fd, &gd, ext2->blocksize, ext2->blocks_per_group, blockgroup_no);
-	if (res)
-		return res;
-	return gd.bg_inode_table;
-}
-
 int read_inode(const struct ext2 *ext2, struct ext2_inode *inode, u32 ino) {
+	EXT2_STATS_START(start);
+	if (ino == 0 || ino > ext2->inodes_count) {
+		errno = ERR_FS_NOT_FOUND;
+		return -1;
+	}
 	/*** Because inodes count begins from 1 ***/
 	ino--;
-	int res;
 	struct ext2_inode inode_on_disk;
-	u32 inode_index = ino % ext2->inodes_per_group;
-	u32 inode_table = get_inode_table_by_inode_number(ext2, ino);
-	u32 offset = inode_table * ext2->blocksize + inode_index * ext2->inode_size;
-	res = pread(ext2->fd, &inode_on_disk, sizeof(struct ext2_inode), offset);
-	if (res != sizeof(struct ext2_inode)) {
-		errno = ERR_FS_IO;
+	u32 group = ino / ext2->inodes_per_group;
+	if (group >= ext2->groups_count) { /*** s_inodes_count larger than groups hold ***/
+		errno = ERR_FS_CORRUPT;
 		return -1;
 	}
+	u32 inode_index = ino % ext2->inodes_per_group;
+	u32 inode_table = ext2->groups.inode_table[group];
+	u64 offset = (u64)inode_index * ext2->inode_size;
+	struct ext2_block *block = ext2_bread(ext2, inode_table + offset / ext2->blocksize);
+	if (!block)
+		return -1;
+	memcpy(&inode_on_disk, block->data + offset % ext2->blocksize, sizeof(struct ext2_inode));
+	ext2_brelse(ext2, block);
 	inode->i_mode = le16toh(inode_on_disk.i_mode);
 	inode->i_uid = le16toh(inode_on_disk.i_uid);
 	inode->i_size = le32toh(inode_on_disk.i_size);
@@ -127,29 +289,641 @@ int read_inode(const struct ext2 *ext2, struct ext2_inode *inode, u32 ino) {
 	inode->i_file_acl = le32toh(inode_on_disk.i_file_acl);
 	inode->i_dir_acl = le32toh(inode_on_disk.i_dir_acl);
 	inode->i_faddr = le32toh(inode_on_disk.i_faddr);
+	EXT2_STATS_RECORD(ext2, EXT2_STAT_READ_INODE, start, 0);
+	return 0;
+}
+
+u64 ext2_inode_size(const struct ext2_inode *inode) {
+	/*** Other inodes keep real directory ACL there ***/
+	if (IFREG(inode->i_mode))
+		return inode->i_size | (u64)inode->i_dir_acl << 32;
+	return inode->i_size;
+}
+
+u8 ext2_mode_to_file_type(u16 mode) {
+	switch (mode & EXT2_S_IFMT) {
+	case EXT2_S_IFREG: return EXT2_FT_REG_FILE;
+	case EXT2_S_ISDIR: return EXT2_FT_DIR;
+	case EXT2_S_IFCHR: return EXT2_FT_CHRDEV;
+	case EXT2_S_IFBLK: return EXT2_FT_BLKDEV;
+	case EXT2_S_IFIFO: return EXT2_FT_FIFO;
+	case EXT2_S_IFSOCK: return EXT2_FT_SOCK;
+	case EXT2_S_IFLNK: return EXT2_FT_SYMLINK;
+	}
+	return EXT2_FT_UNKNOWN;
+}
+
+const char *ext2_strerror(int err) {
+	switch (err) {
+	case ERR_FS_IO: return "I/O error while reading fs";
+	case ERR_FS_NOT_EXT2: return "Not an ext2 fs";
+	case ERR_FS_INCOMPAT: return "Incompatible ext2 features";
+	case ERR_FS_NOT_DIR: return "Not a directory";
+	case ERR_FS_NOT_FOUND: return "Not found";
+	case ERR_FS_CACHE_FULL: return "Block cache is full";
+	case ERR_FS_CORRUPT: return "Corrupt fs structure";
+	}
+	return strerror(err);
+}
+
+/*** Block cache ***/
+
+static u32 cache_hash(const struct ext2_cache *cache, u32 block_no) {
+	return (block_no * 2654435761u) & cache->hash_mask;
+}
+
+static int cache_init(struct ext2 *ext2, size_t cache_size) {
+	struct ext2_cache *cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return -1;
+	u32 nr_blocks = cache_size / ext2->blocksize;
+	if (nr_blocks < EXT2_CACHE_MIN_BLOCKS)
+		nr_blocks = EXT2_CACHE_MIN_BLOCKS;
+	u32 hash_size = 1;
+	while (hash_size < nr_blocks)
+		hash_size <<= 1;
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->loaded, NULL);
+	cache->nr_blocks = nr_blocks;
+	cache->hash_mask = hash_size - 1;
+	cache->blocks = calloc(nr_blocks, sizeof(*cache->blocks));
+	cache->hash = calloc(hash_size, sizeof(*cache->hash));
+	ext2->cache = cache;
+	if (!cache->blocks || !cache->hash)
+		return -1;
+	if (ext2->map) /*** Blocks point into mapped image ***/
+		return 0;
+	cache->mem = malloc((size_t)nr_blocks * ext2->blocksize);
+	if (!cache->mem)
+		return -1;
+	for (u32 i = 0; i < nr_blocks; ++i)
+		cache->blocks[i].data = cache->mem + (size_t)i * ext2->blocksize;
+	return 0;
+}
+
+static void cache_free(struct ext2_cache *cache) {
+	if (!cache)
+		return;
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->loaded);
+	free(cache->blocks);
+	free(cache->hash);
+	free(cache->mem);
+	free(cache);
+}
+
+static void cache_unhash(struct ext2_cache *cache, struct ext2_block *block) {
+	struct ext2_block **p = &cache->hash[cache_hash(cache, block->block_no)];
+	for (; *p; p = &(*p)->hash_next) {
+		if (*p == block) {
+			*p = block->hash_next;
+			break;
+		}
+	}
+	block->valid = 0;
+}
+
+static struct ext2_block *cache_evict(struct ext2_cache *cache) {
+	/*** CLOCK: second pass over the ring finds a victim if any is unpinned ***/
+	for (u32 scanned = 0; scanned < 2 * cache->nr_blocks; ++scanned) {
+		struct ext2_block *block = &cache->blocks[cache->clock_hand];
+		cache->clock_hand = (cache->clock_hand + 1) % cache->nr_blocks;
+		if (__atomic_load_n(&block->refcount, __ATOMIC_ACQUIRE))
+			continue;
+		if (block->referenced) {
+			block->referenced = 0;
+			continue;
+		}
+		if (block->valid)
+			cache_unhash(cache, block);
+		return block;
+	}
+	return NULL;
+}
+
+struct ext2_block *ext2_bread(const struct ext2 *ext2, u32 block_no) {
+	/*** Lock is dropped while block is read, other readers of it wait for loaded ***/
+	struct ext2_cache *cache = ext2->cache;
+	u32 h = cache_hash(cache, block_no);
+	struct ext2_block *block;
+	pthread_mutex_lock(&cache->lock);
+	for (block = cache->hash[h]; block; block = block->hash_next) {
+		if (block->block_no == block_no) {
+			cache->hits++;
+			__atomic_add_fetch(&block->refcount, 1, __ATOMIC_RELAXED);
+			block->referenced = 1;
+			while (block->loading)
+				pthread_cond_wait(&cache->loaded, &cache->lock);
+			if (!block->valid) { /*** Read failed in other thread ***/
+				__atomic_sub_fetch(&block->refcount, 1, __ATOMIC_RELAXED);
+				block = NULL;
+				errno = ERR_FS_IO;
+			}
+			pthread_mutex_unlock(&cache->lock);
+			return block;
+		}
+	}
+	cache->misses++;
+	block = cache_evict(cache);
+	if (!block) {
+		pthread_mutex_unlock(&cache->lock);
+		errno = ERR_FS_CACHE_FULL;
+		return NULL;
+	}
+	block->block_no = block_no;
+	block->valid = 1;
+	block->loading = 1;
+	block->referenced = 1;
+	__atomic_store_n(&block->refcount, 1, __ATOMIC_RELAXED);
+	block->hash_next = cache->hash[h];
+	cache->hash[h] = block;
+	pthread_mutex_unlock(&cache->lock);
+	int res = 0;
+	u64 offset = (u64)block_no * ext2->blocksize;
+	if (ext2->map) {
+		const u8 *data = ext2->io->map(ext2, offset, ext2->blocksize);
+		if (data)
+			block->data = (u8 *)data;
+		else
+			res = -1;
+	} else {
+		res = ext2_io_read(ext2, block->data, ext2->blocksize, offset);
+	}
+	pthread_mutex_lock(&cache->lock);
+	block->loading = 0;
+	if (res) {
+		cache_unhash(cache, block);
+		__atomic_sub_fetch(&block->refcount, 1, __ATOMIC_RELAXED);
+		block = NULL;
+	}
+	pthread_cond_broadcast(&cache->loaded);
+	pthread_mutex_unlock(&cache->lock);
+	return block;
+}
+
+void ext2_brelse(const struct ext2 *ext2, struct ext2_block *block) {
+	/*** Pins are only taken under lock, dropping one is an atomic decrement ***/
+	(void)ext2;
+	if (block)
+		__atomic_sub_fetch(&block->refcount, 1, __ATOMIC_RELEASE);
+}
+
+void ext2_cache_stats(const struct ext2 *ext2, u64 *hits, u64 *misses) {
+	*hits = ext2->cache->hits;
+	*misses = ext2->cache->misses;
+}
+
+void ext2_le32_to_cpu_array(u32 *dst, const __le32 *src, size_t n) {
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	memcpy(dst, src, n * sizeof(u32));
+#else
+	/*** Plain loop without aliasing so compiler vectorizes bswap ***/
+	for (size_t i = 0; i < n; ++i)
+		dst[i] = __builtin_bswap32(src[i]);
+#endif
+}
+
+int ext2_read_block_map(const struct ext2 *ext2, u32 block_no, u32 *map) {
+	struct ext2_block *block = ext2_bread(ext2, block_no);
+	if (!block)
+		return -1;
+	ext2_le32_to_cpu_array(map, (const __le32 *)block->data, ext2->blocksize / sizeof(u32));
+	ext2_brelse(ext2, block);
+	return 0;
+}
+
+/*** Extent map ***/
+
+static int extent_map_add(struct ext2_extent_map *map, u32 logical, u32 physical, u32 len) {
+	if (map->count) {
+		struct ext2_extent *last = &map->extents[map->count - 1];
+		if (physical ? last->physical && last->physical + last->len == physical : !last->physical) {
+			last->len += len;
+			return 0;
+		}
+	}
+	if (map->count == map->capacity) {
+		u32 capacity = map->capacity ? map->capacity * 2 : 16;
+		struct ext2_extent *extents = ext2_pool_realloc(map->extents, map->capacity * sizeof(*extents), capacity * sizeof(*extents));
+		if (!extents)
+			return -1;
+		map->extents = extents;
+		map->capacity = capacity;
+	}
+	map->extents[map->count++] = (struct ext2_extent){ logical, physical, len };
+	return 0;
+}
+
+static int extent_map_tree(const struct ext2 *ext2, struct ext2_extent_map *map, u32 block_no, int depth, u32 *logical, u32 nblocks, u32 *scratch) {
+	/*** Append blocks reachable from indirect block of given depth ***/
+	/*** scratch holds one decoded map for each level below ***/
+	u32 per_block = ext2->blocksize / sizeof(u32);
+	u64 span = 1;
+	for (int i = 0; i < depth; ++i)
+		span *= per_block;
+	if (block_no == 0) { /*** Whole subtree is a hole ***/
+		u32 len = span < nblocks - *logical ? span : nblocks - *logical;
+		*logical += len;
+		return extent_map_add(map, *logical - len, 0, len);
+	}
+	if (ext2_read_block_map(ext2, block_no, scratch))
+		return -1;
+	for (u32 i = 0; i < per_block && *logical < nblocks; ++i) {
+		if (depth == 1) {
+			if (extent_map_add(map, *logical, scratch[i], 1))
+				return -1;
+			++*logical;
+		} else if (extent_map_tree(ext2, map, scratch[i], depth - 1, logical, nblocks, scratch + per_block)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int ext2_inode_extents(const struct ext2 *ext2, const struct ext2_inode *inode, struct ext2_extent_map *map) {
+	map->extents = NULL;
+	map->count = map->capacity = 0;
+	u32 nblocks = (ext2_inode_size(inode) + ext2->blocksize - 1) / ext2->blocksize;
+	u32 logical = 0;
+	for (; logical < EXT2_NDIR_BLOCKS && logical < nblocks; ++logical)
+		if (extent_map_add(map, logical, inode->i_block[logical], 1))
+			goto err_ext2_inode_extents;
+	if (logical == nblocks)
+		return 0;
+	u32 *scratch = ext2_pool_alloc(3 * ext2->blocksize);
+	if (!scratch)
+		goto err_ext2_inode_extents;
+	for (int depth = 1; depth <= 3 && logical < nblocks; ++depth) {
+		if (extent_map_tree(ext2, map, inode->i_block[EXT2_IND_BLOCK + depth - 1], depth, &logical, nblocks, scratch)) {
+			ext2_pool_free(scratch);
+			goto err_ext2_inode_extents;
+		}
+	}
+	ext2_pool_free(scratch);
 	return 0;
+err_ext2_inode_extents:
+	ext2_extent_map_free(map);
+	return -1;
+}
+
+void ext2_extent_map_free(struct ext2_extent_map *map) {
+	ext2_pool_free(map->extents);
+	map->extents = NULL;
+	map->count = map->capacity = 0;
+}
+
+static u32 extent_map_index(const struct ext2_extent_map *map, u32 logical) {
+	/*** Index of extent that holds logical, count when past the end ***/
+	u32 lo = 0, hi = map->count;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		const struct ext2_extent *extent = &map->extents[mid];
+		if (logical < extent->logical)
+			hi = mid;
+		else if (logical >= extent->logical + extent->len)
+			lo = mid + 1;
+		else
+			return mid;
+	}
+	return map->count;
+}
+
+u32 ext2_extent_map_lookup(const struct ext2_extent_map *map, u32 logical) {
+	u32 i = extent_map_index(map, logical);
+	if (i == map->count)
+		return 0;
+	const struct ext2_extent *extent = &map->extents[i];
+	return extent->physical ? extent->physical + (logical - extent->logical) : 0;
+}
+
+/*** Inode data iterator ***/
+
+int ext2_inode_blocks_iter_new(struct ext2_inode_blocks_iter *iter, const struct ext2 *ext2, u32 ino) {
+	int res;
+	iter->ext2 = ext2;
+	iter->offset = 0;
+	iter->extent = 0;
+	iter->map.extents = NULL;
+	iter->ra_buf = NULL;
+	iter->ra_start = iter->ra_len = 0;
+	iter->ra_window = 0;
+	iter->ra_prev = 0;
+	res = read_inode(ext2, &iter->ino, ino);
+	if (res)
+		return res;
+	return ext2_inode_extents(ext2, &iter->ino, &iter->map);
+}
+
+static const struct ext2_extent *iter_extent(struct ext2_inode_blocks_iter *iter) {
+	/*** Extent that contains current offset ***/
+	u32 block = iter->offset / iter->ext2->blocksize;
+	while (iter->extent < iter->map.count) {
+		const struct ext2_extent *extent = &iter->map.extents[iter->extent];
+		if (block < extent->logical + extent->len)
+			return extent;
+		iter->extent++;
+	}
+	errno = ERR_FS_IO;
+	return NULL;
+}
+
+static void iter_prefetch(struct ext2_inode_blocks_iter *iter, u64 start, u64 len) {
+	/*** WILLNEED for file range [start, start + len) ***/
+	/*** Extents less than len apart on disk share one advice, gaps they span cost less than a syscall per extent ***/
+	u32 block_size = iter->ext2->blocksize;
+	u64 size = ext2_inode_size(&iter->ino);
+	if (start >= size)
+		return;
+	if (len > size - start)
+		len = size - start;
+	u32 first = start / block_size;
+	u32 last = (start + len - 1) / block_size;
+	u64 from_pos = 0, to_pos = 0; /*** Image range of pending advice, empty when equal ***/
+	for (u32 i = extent_map_index(&iter->map, first); i < iter->map.count; ++i) {
+		const struct ext2_extent *extent = &iter->map.extents[i];
+		if (extent->logical > last)
+			break;
+		if (!extent->physical)
+			continue;
+		u32 from = extent->logical > first ? extent->logical : first;
+		u32 to = extent->logical + extent->len - 1 < last ? extent->logical + extent->len - 1 : last;
+		u64 pos = (u64)(extent->physical + (from - extent->logical)) * block_size;
+		u64 end = pos + (u64)(to - from + 1) * block_size;
+		if (from_pos != to_pos && pos >= to_pos && pos - to_pos <= len) {
+			to_pos = end;
+			continue;
+		}
+		if (from_pos != to_pos)
+			ext2_io_advise(iter->ext2, from_pos, to_pos - from_pos, EXT2_ADVICE_WILLNEED);
+		from_pos = pos;
+		to_pos = end;
+	}
+	if (from_pos != to_pos)
+		ext2_io_advise(iter->ext2, from_pos, to_pos - from_pos, EXT2_ADVICE_WILLNEED);
+}
+
+static int iter_readahead(struct ext2_inode_blocks_iter *iter) {
+	/*** Fills window at current offset with as few backend reads as extents allow ***/
+	u32 block_size = iter->ext2->blocksize;
+	u32 min = EXT2_RA_MIN_SIZE > block_size ? EXT2_RA_MIN_SIZE : block_size;
+	if (iter->offset == iter->ra_prev) /*** Sequential, window grows ***/
+		iter->ra_window = iter->ra_window ? iter->ra_window * 2 : min;
+	else /*** Random, read only what was asked ***/
+		iter->ra_window = block_size;
+	if (iter->ra_window > EXT2_RA_MAX_SIZE)
+		iter->ra_window = EXT2_RA_MAX_SIZE;
+	if (!iter->ra_buf) {
+		iter->ra_buf = ext2_pool_alloc(EXT2_RA_MAX_SIZE);
+		if (!iter->ra_buf)
+			return -1;
+	}
+	u64 offset = iter->offset;
+	iter->ra_start = offset - offset % block_size;
+	iter->ra_len = 0;
+	iter->offset = iter->ra_start;
+	ssize_t res = 0;
+	while (iter->ra_len < iter->ra_window) {
+		res = ext2_inode_blocks_iter_next_run(iter, iter->ra_buf + iter->ra_len, iter->ra_window - iter->ra_len);
+		if (res <= 0)
+			break;
+		iter->ra_len += res;
+	}
+	/*** Back to caller position, next_run may have passed its extent ***/
+	iter->offset = offset;
+	iter->extent = extent_map_index(&iter->map, offset / block_size);
+	if (res < 0 && iter->ra_len <= offset - iter->ra_start) { /*** Nothing usable was read ***/
+		iter->ra_len = 0;
+		return -1;
+	}
+	/*** Kernel fetches next window while caller consumes this one ***/
+	if (iter->ra_window > block_size)
+		iter_prefetch(iter, iter->ra_start + iter->ra_len, (u64)iter->ra_window * 2);
+	return 0;
+}
+
+int ext2_inode_blocks_iter_next(struct ext2_inode_blocks_iter *iter, void *buf) {
+	/*** Return number of readed bytes ***/
+	/*** Or -1 and set errno on error ***/
+	EXT2_STATS_START(start);
+	u64 size = ext2_inode_size(&iter->ino);
+	u32 block_size = iter->ext2->blocksize;
+	if (iter->offset >= size)
+		return 0;
+	if (iter->offset < iter->ra_start || iter->offset >= iter->ra_start + iter->ra_len)
+		if (iter_readahead(iter))
+			return -1;
+	u32 in_window = iter->offset - iter->ra_start;
+	u32 res = block_size - iter->offset % block_size;
+	if (res > size - iter->offset)
+		res = size - iter->offset;
+	if (res > iter->ra_len - in_window)
+		res = iter->ra_len - in_window;
+	memcpy(buf, iter->ra_buf + in_window, res);
+	iter->offset += res;
+	iter->ra_prev = iter->offset;
+	EXT2_STATS_RECORD(iter->ext2, EXT2_STAT_ITER_NEXT, start, res);
+	return res;
+}
+
+ssize_t ext2_inode_blocks_iter_next_run(struct ext2_inode_blocks_iter *iter, void *buf, size_t len) {
+	u64 size = ext2_inode_size(&iter->ino);
+	u32 block_size = iter->ext2->blocksize;
+	if (iter->offset >= size)
+		return 0;
+	const struct ext2_extent *extent = iter_extent(iter);
+	if (!extent)
+		return -1;
+	u64 extent_end = (u64)(extent->logical + extent->len) * block_size;
+	if (extent_end > size)
+		extent_end = size;
+	if (len > extent_end - iter->offset)
+		len = extent_end - iter->offset;
+	if (extent->physical) {
+		u64 extent_start = (u64)extent->physical * block_size;
+		u64 pos = extent_start + (iter->offset - (u64)extent->logical * block_size);
+		if (ext2_io_read(iter->ext2, buf, len, pos))
+			return -1;
+	} else {
+		memset(buf, 0, len);
+	}
+	iter->offset += len;
+	return len;
+}
+
+off_t ext2_inode_blocks_iter_lseek(struct ext2_inode_blocks_iter *iter, off_t offset, int whence) {
+	/*** Returns new offset, or -1 and sets errno like lseek ***/
+	u64 size = ext2_inode_size(&iter->ino);
+	u32 block_size = iter->ext2->blocksize;
+	switch (whence) {
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += iter->offset;
+		break;
+	case SEEK_END:
+		offset += size;
+		break;
+	case SEEK_DATA:
+	case SEEK_HOLE: {
+		if (offset < 0 || (u64)offset >= size) {
+			errno = ENXIO;
+			return -1;
+		}
+		u64 found = size; /*** End of file counts as a hole ***/
+		for (u32 i = extent_map_index(&iter->map, offset / block_size); i < iter->map.count; ++i) {
+			const struct ext2_extent *extent = &iter->map.extents[i];
+			if (!extent->physical == (whence == SEEK_HOLE)) {
+				u64 start = (u64)extent->logical * block_size;
+				found = start > (u64)offset ? start : (u64)offset;
+				break;
+			}
+		}
+		if (found >= size && whence == SEEK_DATA) {
+			errno = ENXIO;
+			return -1;
+		}
+		offset = found < size ? found : size;
+		break;
+	}
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	iter->offset = offset;
+	iter->extent = (u64)offset < size ? extent_map_index(&iter->map, offset / block_size) : 0;
+	return offset;
+}
+
+int ext2_inode_blocks_iter_end(struct ext2_inode_blocks_iter *iter) {
+	ext2_pool_free(iter->ra_buf);
+	iter->ra_buf = NULL;
+	ext2_extent_map_free(&iter->map);
+	return 0;
+}
+
+static int is_power_of(u32 n, u32 base) {
+	while (n % base == 0)
+		n /= base;
+	return n == 1;
+}
+
+int ext2_group_has_super(const struct ext2 *ext2, u32 group) {
+	if (group <= 1 || !(ext2->feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+		return 1;
+	return is_power_of(group, 3) || is_power_of(group, 5) || is_power_of(group, 7);
 }
 
 int ext2_open(struct ext2 *ext2, const char *path) {
+	return ext2_open_opts(ext2, path, NULL);
+}
+
+static int open_opts(struct ext2 *ext2, const char *path, const struct ext2_opts *opts) {
+	ext2->cache = NULL;
+	ext2->dcache = NULL;
+	ext2->groups.block_bitmap = NULL;
+	ext2->map = NULL;
+	ext2->io = &pread_ops;
 	int fd = open(path, O_RDONLY);
 	if (fd < 0)
 		return errno; // Error opening fs, returning errno from open
 	ext2->fd = fd;
 	int res;
+	/*** Image backend, st_size of a block device is 0 so ask the device ***/
+	struct stat st;
+	if (fstat(fd, &st))
+		return -1;
+	ext2->image_size = st.st_size;
+	if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &ext2->image_size))
+		ext2->image_size = 0;
+	/*** Mapping needs the size, pread works without it ***/
+	if (opts && opts->backend == EXT2_IO_MMAP && ext2->image_size)
+		ext2->io = &mmap_ops;
+	res = ext2->io->open(ext2);
+	if (res)
+		return res;
 	/*** Reading superblock ***/
 	struct ext2_super_block superblock;
-	res = read_super_block(fd, &superblock);
+	res = read_super_block(ext2, &superblock);
 	if (res)
 		return res;
 	ext2->blocksize = 1024 << superblock.s_log_block_size;
 	ext2->inode_size = superblock.s_inode_size;
 	ext2->inodes_per_group = superblock.s_inodes_per_group;
 	ext2->blocks_per_group = superblock.s_blocks_per_group;
+	ext2->first_data_block = superblock.s_first_data_block;
+	ext2->blocks_count = superblock.s_blocks_count;
+	ext2->inodes_count = superblock.s_inodes_count;
+	ext2->free_blocks_count = superblock.s_free_blocks_count;
+	ext2->free_inodes_count = superblock.s_free_inodes_count;
+	ext2->first_ino = superblock.s_first_ino;
+	if (superblock.s_rev_level == 0) { /*** Fields of dynamic revision are not there ***/
+		ext2->first_ino = EXT2_GOOD_OLD_FIRST_INO;
+		ext2->inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+	}
+	ext2->feature_compat = superblock.s_feature_compat;
+	ext2->feature_incompat = superblock.s_feature_incompat;
+	ext2->feature_ro_compat = superblock.s_feature_ro_compat;
+	memcpy(ext2->hash_seed, superblock.s_hash_seed, sizeof(ext2->hash_seed));
+	ext2->def_hash_version = superblock.s_def_hash_version;
+	ext2->hash_unsigned = superblock.s_flags & EXT2_FLAGS_UNSIGNED_HASH ? 3 : 0;
+	/*** read_inode copies inode_size bytes out of one table block ***/
+	if (ext2->inode_size < EXT2_GOOD_OLD_INODE_SIZE || ext2->inode_size > ext2->blocksize || (ext2->inode_size & (ext2->inode_size - 1))) {
+		errno = ERR_FS_NOT_EXT2;
+		return -1;
+	}
+	/*** Each group's bitmaps are one block, readers walk them that far ***/
+	if (!ext2->blocks_per_group || !ext2->inodes_per_group || ext2->blocks_per_group > 8 * ext2->blocksize || ext2->inodes_per_group > 8 * ext2->blocksize) {
+		errno = ERR_FS_NOT_EXT2;
+		return -1;
+	}
+	ext2->groups_count = (ext2->blocks_count - ext2->first_data_block + ext2->blocks_per_group - 1) / ext2->blocks_per_group;
+	ext2->gdt_blocks = ((u64)ext2->groups_count * sizeof(struct ext2_group_desc) + ext2->blocksize - 1) / ext2->blocksize;
+	ext2->reserved_gdt_blocks = ext2->feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INO ? superblock.s_reserved_gdt_blocks : 0;
+	/*** Reading group descriptors ***/
+	res = read_group_desc_table(ext2);
+	if (res)
+		return res;
+	/*** Mapped metadata lookups are random, file reads prefetch each readahead window ***/
+	if (ext2->map)
+		ext2_io_advise(ext2, 0, ext2->image_size, EXT2_ADVICE_RANDOM);
+	/*** Block cache ***/
+	size_t cache_size = opts ? opts->cache_size : EXT2_CACHE_DEFAULT_SIZE;
+	res = cache_init(ext2, cache_size);
+	if (res)
+		return res;
+	/*** Dentry cache ***/
+	size_t dcache_size = opts && opts->dcache_size ? opts->dcache_size : EXT2_DCACHE_DEFAULT_SIZE;
+	res = ext2_dcache_init(ext2, dcache_size);
+	if (res)
+		return res;
 	return 0;
 }
 
+int ext2_open_opts(struct ext2 *ext2, const char *path, const struct ext2_opts *opts) {
+	ext2->stats = NULL;
+#ifdef EXT2_STATS
+	if (ext2_stats_init(ext2))
+		return -1;
+#endif
+	EXT2_STATS_START(start);
+	int res = open_opts(ext2, path, opts);
+	if (!res)
+		EXT2_STATS_RECORD(ext2, EXT2_STAT_OPEN, start, 0);
+	return res;
+}
+
 int ext2_close(const struct ext2 *ext2) {
+	cache_free(ext2->cache);
+	ext2_dcache_free(ext2->dcache);
+	free(ext2->groups.block_bitmap);
+	ext2->io->close(ext2);
+#ifdef EXT2_STATS
+	ext2_stats_free(ext2->stats);
+#endif
 	int res = close(ext2->fd);
 	return res;
 }
-
@@ -3,8 +3,12 @@
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
 
 #define BOOT_LOADER_SPACE		1024 /* Number of bytes to boot loader */
+#define EXT2_MAX_BLOCK_SIZE		65536 /* Largest block size of ext2 */
+#define EXT2_MAX_BLOCK_LOG_SIZE	6 /* s_log_block_size of EXT2_MAX_BLOCK_SIZE */
 
 #define	EXT2_NDIR_BLOCKS		12						/* Direct blocks */
 #define	EXT2_IND_BLOCK			EXT2_NDIR_BLOCKS		/* Indirect blocks */
@@ -12,9 +16,23 @@
 #define	EXT2_TIND_BLOCK			(EXT2_DIND_BLOCK + 1)	/* Triple indirect */
 #define	EXT2_N_BLOCKS			(EXT2_TIND_BLOCK + 1)
 
+#define EXT2_FEATURE_COMPAT_RESIZE_INO	0x0010 /* Reserved GDT blocks for growth */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX	0x0020 /* HTree directories */
+#define EXT2_FEATURE_INCOMPAT_FILETYPE	0x0002 /* Directory entries carry file type */
+#define EXT2_FEATURE_INCOMPAT_SUPP	EXT2_FEATURE_INCOMPAT_FILETYPE /* Incompat features we can read */
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001 /* Backup sb only in some groups */
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE	0x0002 /* Regular files keep size high in i_dir_acl */
+#define EXT2_INDEX_FL			0x00001000 /* Directory has HTree index */
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002 /* HTree hashes treat chars as unsigned */
+
 #define EXT2_S_IFMT				0xF000	/* File type mask */
 #define EXT2_S_IFREG			0x8000	/* Regular file */
 #define EXT2_S_ISDIR			0x4000	/* Directory */
+#define EXT2_S_IFLNK			0xA000	/* Symbolic link */
+#define EXT2_S_IFCHR			0x2000	/* Character device */
+#define EXT2_S_IFBLK			0x6000	/* Block device */
+#define EXT2_S_IFIFO			0x1000	/* FIFO */
+#define EXT2_S_IFSOCK			0xC000	/* Socket */
 // TODO 
 
 /*** Error codes ***/
@@ -23,12 +41,26 @@
 #define ERR_FS_INCOMPAT			-5002 /* Incompatible fs */
 #define ERR_FS_NOT_DIR			-5003 /* Iterating not directory */
 #define ERR_FS_NOT_FOUND		-5004 /* Directory by path not found */
+#define ERR_FS_CACHE_FULL		-5005 /* All cached blocks are in use */
+#define ERR_FS_CORRUPT			-5006 /* Malformed on-disk structure */
+
+/*** Message for ERR_FS_* codes and errno values alike ***/
+const char *ext2_strerror(int err);
 
 #define EXT2_ROOT_INO			2 /* Inode number of root directory */
+#define EXT2_RESIZE_INO			7 /* Inode that owns reserved GDT blocks */
+#define EXT2_GOOD_OLD_FIRST_INO	11 /* First non-reserved inode of revision 0 */
+#define EXT2_GOOD_OLD_INODE_SIZE	128
+#define EXT2_NAME_LEN			255 /* Max length of file name */
+
+#define EXT2_CACHE_DEFAULT_SIZE	(4 << 20) /* Block cache budget in bytes */
+#define EXT2_CACHE_MIN_BLOCKS	16 /* Cache never holds less blocks */
+#define EXT2_DCACHE_DEFAULT_SIZE	(1 << 20) /* Dentry cache budget in bytes */
 
 /*** For determing file type ***/
 #define IFREG(mode) (((mode) & EXT2_S_IFMT) == EXT2_S_IFREG)
 #define ISDIR(mode) (((mode) & EXT2_S_IFMT) == EXT2_S_ISDIR)
+#define ISLNK(mode) (((mode) & EXT2_S_IFMT) == EXT2_S_IFLNK)
 
 /*** typedefs for shorter types ***/
 typedef uint8_t u8;
@@ -91,7 +123,7 @@ struct ext2_super_block {
 	 */
 	__u8	s_prealloc_blocks;	/* Nr of blocks to try to preallocate*/
 	__u8	s_prealloc_dir_blocks;	/* Nr to preallocate for dirs */
-	__u16	s_padding1;
+	__le16	s_reserved_gdt_blocks;	/* Per group desc for online growth */
 	/*
 	 * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
 	 */
@@ -105,7 +137,15 @@ struct ext2_super_block {
 	__u16	s_reserved_word_pad;
 	__le32	s_default_mount_opts;
 	__le32	s_first_meta_bg; 	/* First metablock block group */
-	__u32	s_reserved[190];	/* Padding to the end of the block */
+	__le32	s_mkfs_time;		/* When the filesystem was created */
+	__le32	s_jnl_blocks[17]; 	/* Backup of the journal inode */
+	__le32	s_blocks_count_hi;	/* Blocks count high 32 bits */
+	__le32	s_r_blocks_count_hi;	/* Reserved blocks count high 32 bits */
+	__le32	s_free_blocks_hi; 	/* Free blocks count high 32 bits */
+	__le16	s_min_extra_isize;	/* All inodes have at least # bytes */
+	__le16	s_want_extra_isize; 	/* New inodes should reserve # bytes */
+	__le32	s_flags;		/* Miscellaneous flags */
+	__u32	s_reserved[167];	/* Padding to the end of the block */
 };
 
 struct ext2_group_desc
@@ -136,7 +176,7 @@ struct ext2_inode {
 	__le32	i_block[EXT2_N_BLOCKS];/* Pointers to blocks */
 	__le32	i_generation;	/* File version (for NFS) */
 	__le32	i_file_acl;	/* File ACL */
-	__le32	i_dir_acl;	/* Directory ACL */
+	__le32	i_dir_acl;	/* Directory ACL, size high bits of regular file */
 	__le32	i_faddr;	/* Fragment address */
 	__u8	i_osd2[12];	/* OS dependent 2 */
 };
@@ -156,19 +196,463 @@ struct ext2_dir_entry_2 {
 	char	name[];			/* File name, up to EXT2_NAME_LEN */
 };
 
+/*** file_type of ext2_dir_entry_2 ***/
+#define EXT2_FT_UNKNOWN			0 /* Also every entry without filetype feature */
+#define EXT2_FT_REG_FILE		1
+#define EXT2_FT_DIR				2
+#define EXT2_FT_CHRDEV			3
+#define EXT2_FT_BLKDEV			4
+#define EXT2_FT_FIFO			5
+#define EXT2_FT_SOCK			6
+#define EXT2_FT_SYMLINK			7
+#define EXT2_FT_MAX				8
+
+/*** Cached copy of one fs block ***/
+struct ext2_block {
+	u32 block_no;
+	u32 refcount;		/* Handles given out by ext2_bread */
+	u8 referenced;		/* CLOCK reference bit */
+	u8 valid;		/* data holds block_no */
+	u8 loading;		/* Read in progress, wait on cache->loaded */
+	struct ext2_block *hash_next;
+	u8 *data;
+};
+
+/*** Block cache with CLOCK eviction, shared by threads ***/
+struct ext2_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t loaded;
+	struct ext2_block *blocks;
+	struct ext2_block **hash;
+	u8 *mem;		/* nr_blocks * blocksize bytes */
+	u32 nr_blocks;
+	u32 hash_mask;
+	u32 clock_hand;
+	u64 hits;
+	u64 misses;
+};
+
+/*** Cached result of looking up name in directory parent ***/
+struct ext2_dentry {
+	u32 parent;
+	u32 ino;		/* 0 for negative entry */
+	u32 hash;
+	u8 name_len;
+	struct ext2_dentry *hash_next;
+	struct ext2_dentry *lru_prev, *lru_next;
+	char name[];
+};
+
+/*** Dentry cache with LRU eviction, shared by threads ***/
+struct ext2_dcache {
+	pthread_mutex_t lock;
+	struct ext2_dentry **hash;
+	u32 hash_mask;
+	struct ext2_dentry *lru_head;	/* Most recently used */
+	struct ext2_dentry *lru_tail;
+	size_t used;
+	size_t budget;
+	u64 hits;
+	u64 misses;
+};
+
+/*** Group descriptor table, one array per field ***/
+struct ext2_groups {
+	u32 *block_bitmap;
+	u32 *inode_bitmap;
+	u32 *inode_table;
+	u16 *free_blocks_count;
+	u16 *free_inodes_count;
+	u16 *used_dirs_count;
+};
+
+/*** Run of file blocks that are contiguous on disk ***/
+struct ext2_extent {
+	u32 logical;		/* First file block */
+	u32 physical;		/* First fs block, 0 for a hole */
+	u32 len;		/* Number of blocks */
+};
+
+struct ext2_extent_map {
+	struct ext2_extent *extents;
+	u32 count;
+	u32 capacity;
+};
+
+/*** Image backends ***/
+#define EXT2_IO_PREAD			0 /* Copy with pread */
+#define EXT2_IO_MMAP			1 /* Access mapped image in place */
+
+/*** Access pattern hints for ext2_io_advise ***/
+#define EXT2_ADVICE_NORMAL		0
+#define EXT2_ADVICE_SEQUENTIAL	1
+#define EXT2_ADVICE_RANDOM		2
+#define EXT2_ADVICE_WILLNEED	3
+
+struct ext2;
+
+struct ext2_io_ops {
+	int (*open)(struct ext2 *ext2);
+	void (*close)(const struct ext2 *ext2);
+	/*** Copy len bytes at offset to buf ***/
+	int (*read)(const struct ext2 *ext2, void *buf, size_t len, u64 offset);
+	/*** Pointer to len bytes at offset, NULL if backend can only copy ***/
+	const u8 *(*map)(const struct ext2 *ext2, u64 offset, size_t len);
+	void (*advise)(const struct ext2 *ext2, u64 offset, u64 len, int advice);
+};
+
+/*** Options for ext2_open_opts, NULL means defaults ***/
+struct ext2_opts {
+	size_t cache_size;	/* Block cache memory budget in bytes */
+	int backend;		/* EXT2_IO_* */
+	size_t dcache_size;	/* Dentry cache memory budget, 0 for default */
+};
+
 struct ext2 {
 	// a file that contains an ext2 image
 	int fd; 
+	u64 image_size;	/* 0 when size is unknown */
+	const struct ext2_io_ops *io;
+	u8 *map;		/* Whole image for EXT2_IO_MMAP */
 	// ext2 properties that I will need
 	u32 blocksize;
 	u16 inode_size;
 	u32 blocks_per_group;
 	u32 inodes_per_group;
+	u32 first_data_block;
+	u32 blocks_count;
+	u32 inodes_count;
+	u32 groups_count;
+	u32 free_blocks_count;
+	u32 free_inodes_count;
+	u32 first_ino;
+	u32 gdt_blocks;		/* Blocks of group descriptor table */
+	u16 reserved_gdt_blocks;
+	u32 feature_compat;
+	u32 feature_incompat;
+	u32 feature_ro_compat;
+	// HTree directory hashing
+	u32 hash_seed[4];
+	u8 def_hash_version;
+	u8 hash_unsigned;	/* 3 when EXT2_FLAGS_UNSIGNED_HASH, added to hash version */
+	// loaded once by ext2_open
+	struct ext2_groups groups;
+	// every block read goes through it
+	struct ext2_cache *cache;
+	// name lookups go through it
+	struct ext2_dcache *dcache;
+	// hot path counters, NULL unless built with EXT2_STATS
+	struct ext2_stats *stats;
 };
 
 int ext2_open(struct ext2 *ext2, const char *path);
+int ext2_open_opts(struct ext2 *ext2, const char *path, const struct ext2_opts *opts);
 int ext2_close(const struct ext2 *ext2);
 int read_inode(const struct ext2 *ext2, struct ext2_inode *inode, u32 inode_number);
+/*** Size with high bits from i_dir_acl for regular files ***/
+u64 ext2_inode_size(const struct ext2_inode *inode);
+/*** EXT2_FT_* of mode ***/
+u8 ext2_mode_to_file_type(u16 mode);
+
+/*** Group has superblock and group descriptor table copy ***/
+int ext2_group_has_super(const struct ext2 *ext2, u32 group);
+
+/*** Backend access, ext2_io_read returns -1 and sets errno on error ***/
+int ext2_io_read(const struct ext2 *ext2, void *buf, size_t len, u64 offset);
+void ext2_io_advise(const struct ext2 *ext2, u64 offset, u64 len, int advice);
+
+/*** Block cache ***/
+/*** ext2_bread returns NULL and sets errno on error ***/
+/*** Every returned block must be released by ext2_brelse ***/
+struct ext2_block *ext2_bread(const struct ext2 *ext2, u32 block_no);
+void ext2_brelse(const struct ext2 *ext2, struct ext2_block *block);
+void ext2_cache_stats(const struct ext2 *ext2, u64 *hits, u64 *misses);
+
+/*** Thread-local buffer pools, ext2_pool_free may be called from any thread ***/
+void *ext2_pool_alloc(size_t size);
+void *ext2_pool_realloc(void *ptr, size_t old_size, size_t size);
+void ext2_pool_free(void *ptr);
+/*** Pool hits and misses of calling thread ***/
+void ext2_pool_stats(u64 *hits, u64 *misses);
+
+/*** Hot path instrumentation, compiled in only with -DEXT2_STATS ***/
+#define EXT2_STAT_OPEN			0 /* ext2_open_opts */
+#define EXT2_STAT_READ_INODE	1
+#define EXT2_STAT_LOOKUP		2 /* get_ino_in_dir_by_name */
+#define EXT2_STAT_ITER_NEXT		3 /* ext2_inode_blocks_iter_next */
+#define EXT2_STAT_IO_READ		4 /* Backend reads */
+#define EXT2_STAT_OPS			5
+
+#define EXT2_STATS_SUB_BITS		3 /* Histogram buckets are 1/8 of a power of two wide */
+#define EXT2_STATS_BUCKETS		312 /* Up to 2^41 ns, about 36 minutes */
+
+#ifdef EXT2_STATS
+#include <stdio.h>
+
+struct ext2_stats_op {
+	u64 count;		/* Calls that succeeded, only those are timed */
+	u64 bytes;
+	u64 total_ns;
+	u64 max_ns;
+	u64 hist[EXT2_STATS_BUCKETS];
+};
+
+/*** Sum of all threads ***/
+struct ext2_stats_snapshot {
+	struct ext2_stats_op ops[EXT2_STAT_OPS];
+	u64 syscalls;		/* Issued on image fd: reads, advice, copies */
+};
+
+int ext2_stats_init(struct ext2 *ext2);
+void ext2_stats_free(struct ext2_stats *stats);
+u64 ext2_stats_now(void);
+void ext2_stats_record(const struct ext2 *ext2, int op, u64 start, u64 bytes);
+void ext2_stats_syscall(const struct ext2 *ext2);
+/*** Counters may move while they are read, every one of them is consistent ***/
+void ext2_stats_read(const struct ext2 *ext2, struct ext2_stats_snapshot *snapshot);
+/*** Nanoseconds that fraction p of calls did not exceed ***/
+u64 ext2_stats_percentile(const struct ext2_stats_op *op, double p);
+/*** One line JSON object, returns 0 or -1 and sets errno ***/
+int ext2_stats_dump(const struct ext2 *ext2, FILE *out);
+
+#define EXT2_STATS_START(start)					u64 start = ext2_stats_now()
+#define EXT2_STATS_RECORD(ext2, op, start, bytes)	ext2_stats_record(ext2, op, start, bytes)
+#define EXT2_STATS_SYSCALL(ext2)				ext2_stats_syscall(ext2)
+#else
+#define EXT2_STATS_START(start)					do {} while (0)
+#define EXT2_STATS_RECORD(ext2, op, start, bytes)	do {} while (0)
+#define EXT2_STATS_SYSCALL(ext2)				do {} while (0)
+#endif
+
+/*** Decode n little-endian u32, no-op copy on little-endian hosts ***/
+void ext2_le32_to_cpu_array(u32 *dst, const __le32 *src, size_t n);
+/*** Read indirect block and decode blocksize / 4 block numbers to map ***/
+int ext2_read_block_map(const struct ext2 *ext2, u32 block_no, u32 *map);
+
+/*** Extent map of the whole indirect tree ***/
+int ext2_inode_extents(const struct ext2 *ext2, const struct ext2_inode *inode, struct ext2_extent_map *map);
+void ext2_extent_map_free(struct ext2_extent_map *map);
+/*** Physical block of file block logical, 0 for a hole ***/
+u32 ext2_extent_map_lookup(const struct ext2_extent_map *map, u32 logical);
+
+/*** Sequential reader of inode data, holes read as zeros without I/O ***/
+#define EXT2_RA_MIN_SIZE		(16 << 10) /* First readahead window */
+#define EXT2_RA_MAX_SIZE		(1 << 20)
+
+struct ext2_inode_blocks_iter
+{
+	const struct ext2 *ext2;
+	struct ext2_inode ino;
+	
+	u64 offset;
+	struct ext2_extent_map map;
+	u32 extent;		/* Extent that contains offset */
+	// readahead of ext2_inode_blocks_iter_next
+	u8 *ra_buf;		/* File data [ra_start, ra_start + ra_len) */
+	u64 ra_start;
+	u32 ra_len;
+	u32 ra_window;		/* Bytes read at once, doubles while access is sequential */
+	u64 ra_prev;		/* Offset after last next, differs after lseek */
+};
+
+int ext2_inode_blocks_iter_new(struct ext2_inode_blocks_iter *iter, const struct ext2 *ext2, u32 ino);
+/*** Read up to the end of current block from readahead window ***/
+int ext2_inode_blocks_iter_next(struct ext2_inode_blocks_iter *iter, void *buf);
+/*** Read up to len bytes of current extent with single backend read ***/
+ssize_t ext2_inode_blocks_iter_next_run(struct ext2_inode_blocks_iter *iter, void *buf, size_t len);
+/*** Moves iterator like lseek, SEEK_DATA and SEEK_HOLE look holes up in extent map without I/O ***/
+off_t ext2_inode_blocks_iter_lseek(struct ext2_inode_blocks_iter *iter, off_t offset, int whence);
+int ext2_inode_blocks_iter_end(struct ext2_inode_blocks_iter *iter);
+
+/*** Random access reader of inode data, one handle per thread ***/
+#define EXT2_FILE_CACHE_SLOTS	4 /* Decoded indirect blocks kept per file */
+
+struct ext2_file {
+	const struct ext2 *ext2;
+	u32 ino;
+	struct ext2_inode inode;
+	u64 size;
+	struct {
+		u32 block_no;	/* 0 for empty slot */
+		u32 last_used;
+	} cache[EXT2_FILE_CACHE_SLOTS];
+	u32 tick;
+	u32 *maps;		/* blocksize / 4 entries per slot */
+};
+
+int ext2_file_open(struct ext2_file *file, const struct ext2 *ext2, u32 ino);
+/*** Physical block of file block logical, 0 for a hole ***/
+int ext2_file_bmap(struct ext2_file *file, u32 logical, u32 *physical);
+/*** Returns number of read bytes, 0 at the end of file, -1 and sets errno on error ***/
+ssize_t ext2_file_pread(struct ext2_file *file, void *buf, size_t len, u64 offset);
+int ext2_file_close(struct ext2_file *file);
+
+/*** Directory entry as it lies in cached block, valid until next ext2_dir_iter_next ***/
+struct ext2_dirent {
+	u32 inode;
+	u32 rec_len;		/* 65536 fits only here, on disk it is 0 or 65535 */
+	u8 name_len;
+	u8 file_type;		/* EXT2_FT_*, EXT2_FT_UNKNOWN without filetype feature */
+	const char *name;	/* Not NUL terminated */
+};
+
+/*** Directory iterator without per-entry allocation ***/
+struct ext2_dir_iter {
+	struct ext2_inode_blocks_iter blocks;
+	struct ext2_block *block;	/* Held while its entries are in use */
+	u32 block_index;	/* Next file block to read */
+	u32 nblocks;
+	u32 offset;		/* Next entry in block */
+};
+
+int ext2_dir_iter_new(struct ext2_dir_iter *iter, const struct ext2 *ext2, u32 ino);
+/*** Returns 1 for entry, 0 at the end, -1 and sets errno on error ***/
+int ext2_dir_iter_next(struct ext2_dir_iter *iter, struct ext2_dirent *dirent);
+/*** Byte position of next entry, like telldir, valid while directory is unchanged ***/
+u64 ext2_dir_iter_tell(const struct ext2_dir_iter *iter);
+/*** Returns 0, or -1 and sets errno, positions past the end are the end ***/
+int ext2_dir_iter_seek(struct ext2_dir_iter *iter, u64 pos);
+void ext2_dir_iter_end(struct ext2_dir_iter *iter);
+
+/*** Directories ***/
+int get_ino_in_dir_by_name(const struct ext2 *ext2, const u32 inode_number, const char *req_name, size_t name_len);
+/*** HTree, returns -1 with ERR_FS_CORRUPT when index can't be used ***/
+int ext2_htree_lookup(const struct ext2_inode_blocks_iter *dir, const char *name, size_t name_len);
+/*** Finds name in one directory block, zero if not found ***/
+int ext2_dir_block_find(const struct ext2 *ext2, u32 block_no, const char *name, size_t name_len);
+/*** Lookups through dentry cache ***/
+/*** ext2_lookup returns inode number, zero if not found, negative on error ***/
+int ext2_lookup(const struct ext2 *ext2, u32 dir_ino, const char *name, size_t name_len);
+/*** ext2_lookup_path returns inode number or -1 and sets errno ***/
+int ext2_lookup_path(const struct ext2 *ext2, const char *path);
+int ext2_dcache_init(struct ext2 *ext2, size_t budget);
+void ext2_dcache_free(struct ext2_dcache *dcache);
+void ext2_dcache_stats(const struct ext2 *ext2, u64 *hits, u64 *misses);
+
+/*** Parallel walk over the whole tree ***/
+/*** Called from worker threads at once, nonzero return stops the walk ***/
+typedef int (*ext2_walk_cb_t)(void *arg, const char *path, u32 ino, const struct ext2_inode *inode);
+
+struct ext2_walk_stats {
+	u64 entries;
+	u64 dirs;
+	double seconds;
+	double entries_per_sec;
+};
+
+/*** nr_threads 0 means one per online CPU, stats may be NULL ***/
+int ext2_walk(const struct ext2 *ext2, u32 nr_threads, ext2_walk_cb_t cb, void *arg, struct ext2_walk_stats *stats);
+/*** Walk of subtree of directory ino, which gets path "/" ***/
+int ext2_walk_from(const struct ext2 *ext2, u32 ino, u32 nr_threads, ext2_walk_cb_t cb, void *arg, struct ext2_walk_stats *stats);
+
+/*** Walk that gives names and EXT2_FT_* types only ***/
+/*** With filetype feature only directories get read, no inode at all ***/
+typedef int (*ext2_walk_names_cb_t)(void *arg, const char *path, u32 ino, u8 file_type);
+int ext2_walk_names(const struct ext2 *ext2, u32 ino, u32 nr_threads, ext2_walk_names_cb_t cb, void *arg, struct ext2_walk_stats *stats);
+
+/*** Inode table scan, inodes decoded in batches into one array per field ***/
+#define EXT2_SCAN_DEFAULT_BATCH	512
+
+struct ext2_inode_batch {
+	u32 first_ino;		/* Inode number of element 0 */
+	u32 count;
+	u16 *mode;
+	u16 *uid;
+	u16 *gid;
+	u16 *links_count;
+	u64 *size;		/* With high bits of regular files */
+	u32 *mtime;
+	u32 *dtime;
+	u32 *blocks;
+	u32 *flags;
+	u32 *file_acl;		/* Extended attribute block, 0 for none */
+	u32 *block;		/* EXT2_N_BLOCKS pointers of element i at block[i * EXT2_N_BLOCKS] */
+};
+
+struct ext2_inode_scan {
+	const struct ext2 *ext2;
+	u32 group;
+	u32 end_group;
+	u32 index;		/* Next inode in group */
+	u32 batch_size;
+	u8 *buf;		/* Raw inodes for pread backend */
+	struct ext2_inode_batch batch;
+};
+
+/*** batch_size 0 means EXT2_SCAN_DEFAULT_BATCH ***/
+int ext2_inode_scan_new(struct ext2_inode_scan *scan, const struct ext2 *ext2, u32 batch_size);
+/*** Limit scan to groups [first_group, end_group) ***/
+void ext2_inode_scan_range(struct ext2_inode_scan *scan, u32 first_group, u32 end_group);
+/*** Fills scan->batch, returns number of inodes, 0 at the end, -1 on error ***/
+int ext2_inode_scan_next(struct ext2_inode_scan *scan);
+void ext2_inode_scan_end(struct ext2_inode_scan *scan);
+
+/*** Used and free space from bitmaps ***/
+#define EXT2_FREE_RUN_ORDERS	32
+
+struct ext2_usage {
+	u64 blocks_count;
+	u64 free_blocks;	/* Zero bits in block bitmaps */
+	u64 inodes_count;
+	u64 free_inodes;	/* Zero bits in inode bitmaps */
+	/*** Counters on disk to cross-check against ***/
+	u64 sb_free_blocks;
+	u64 sb_free_inodes;
+	u64 gd_free_blocks;	/* Sum over group descriptors */
+	u64 gd_free_inodes;
+	u32 mismatched_groups;	/* Bitmap disagrees with its group descriptor */
+	/*** free_runs[i] counts free block runs of length in [2^i, 2^(i+1)) ***/
+	u64 free_runs[EXT2_FREE_RUN_ORDERS];
+	u64 largest_free_run;
+	u64 largest_free_run_start;
+	const char *kernel;	/* Popcount implementation used */
+};
+
+/*** Returns 0, or -1 and sets errno ***/
+int ext2_usage_stats(const struct ext2 *ext2, struct ext2_usage *usage);
+/*** Number of set bits in len bytes, best kernel for this CPU ***/
+u64 ext2_popcount(const u8 *data, size_t len);
+
+/*** Reading inode data with queue_depth reads in flight ***/
+#define EXT2_AIO_AUTO			0 /* io_uring, threads if unavailable */
+#define EXT2_AIO_URING			1
+#define EXT2_AIO_THREADS		2
+#define EXT2_AIO_DEFAULT_DEPTH	8
+#define EXT2_AIO_DEFAULT_CHUNK	(128 << 10)
+
+struct ext2_aio_opts {
+	int engine;		/* EXT2_AIO_* */
+	u32 queue_depth;	/* Reads in flight */
+	size_t chunk_size;	/* Max bytes per read */
+	u32 threads;		/* Thread engine workers, 0 means queue_depth */
+};
+
+/*** Gets file data in logical order, nonzero return stops reading ***/
+typedef int (*ext2_aio_consume_t)(void *arg, const void *buf, size_t len);
+
+/*** opts may be NULL for defaults ***/
+int ext2_aio_read(const struct ext2 *ext2, u32 ino, const struct ext2_aio_opts *opts, ext2_aio_consume_t consume, void *arg);
+
+/*** Copying inode data to host fd with copy_file_range/sendfile, holes stay holes ***/
+#define EXT2_EXTRACT_BUF_SIZE	(1 << 20) /* Buffer of plain write fallback */
+
+/*** Writes at current offset of out_fd, returns 0, or -1 and sets errno ***/
+int ext2_extract(const struct ext2 *ext2, u32 ino, int out_fd);
+/*** Same for first size bytes of already built extent map ***/
+int ext2_extract_map(const struct ext2 *ext2, const struct ext2_extent_map *map, u64 size, int out_fd);
+
+/*** Mirroring subtree at path into host_dir, created if missing ***/
+/*** Directories, regular files and symlinks are copied, other inodes skipped ***/
+struct ext2_extract_stats {
+	u64 dirs;
+	u64 files;
+	u64 symlinks;
+	u64 bytes;
+	double seconds;
+};
+
+/*** nr_threads 0 means one per online CPU for walkers and for writers, stats may be NULL ***/
+int ext2_extract_tree(const struct ext2 *ext2, const char *path, const char *host_dir, u32 nr_threads, struct ext2_extract_stats *stats);
 
 #endif	/* EXT2_H */
 
@@ -0,0 +1,463 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "ext2.h"
+
+/*******************
+ * Reading inode data with many reads in flight.
+ * File is split into chunks of at most chunk_size bytes that never cross an extent.
+ * Chunks sit in a ring of queue_depth slots, consumer takes them in logical order
+ * and refills the slot with the next chunk.
+ * Engines: io_uring (raw syscalls, no liburing needed) and a pool of pread threads.
+ * Kernels before 5.6 set the ring up but fail IORING_OP_READ with EINVAL, so
+ * the first ring of a process reads one sector to find out, and without the
+ * opcode reads go to the thread pool as if there was no io_uring at all.
+ ******************/
+
+#define SLOT_FREE		0
+#define SLOT_PENDING	1 /* Waiting for engine */
+#define SLOT_BUSY		2 /* Worker thread is reading it */
+#define SLOT_DONE		3
+
+struct aio_slot {
+	u8 *buf;
+	u64 pos;		/* Offset in image */
+	u32 len;
+	int hole;		/* Zero filled, no I/O */
+	int state;
+	int err;		/* errno of failed or short read, 0 when all was read */
+};
+
+struct aio_plan {
+	const struct ext2 *ext2;
+	const struct ext2_extent_map *map;
+	u64 size;
+	u64 offset;		/* Next file offset to plan */
+	u32 extent;
+	size_t chunk_size;
+};
+
+struct aio_uring {
+	int fd;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	u32 *sq_head, *sq_tail, *sq_mask, *sq_array;
+	u32 *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+struct aio_threads {
+	pthread_t *threads;
+	u32 nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* Slot became pending or stop */
+	pthread_cond_t done;	/* Slot became done */
+	int stop;
+};
+
+struct aio {
+	const struct ext2 *ext2;
+	struct aio_slot *slots;
+	u32 depth;
+	int engine;
+	struct aio_uring uring;
+	struct aio_threads pool;
+	u8 probe[512];		/* Target of uring_probe, chunk buffers may be smaller */
+};
+
+/*** Planning chunks ***/
+
+static int plan_next(struct aio_plan *plan, struct aio_slot *slot) {
+	/*** Returns 0 when whole file is planned ***/
+	u32 block_size = plan->ext2->blocksize;
+	if (plan->offset == plan->size)
+		return 0;
+	u32 block = plan->offset / block_size;
+	const struct ext2_extent *extent = NULL;
+	while (plan->extent < plan->map->count) {
+		extent = &plan->map->extents[plan->extent];
+		if (block < extent->logical + extent->len)
+			break;
+		plan->extent++;
+		extent = NULL;
+	}
+	if (!extent) {
+		errno = ERR_FS_IO;
+		return -1;
+	}
+	u64 extent_end = (u64)(extent->logical + extent->len) * block_size;
+	if (extent_end > plan->size)
+		extent_end = plan->size;
+	u64 len = extent_end - plan->offset;
+	if (len > plan->chunk_size)
+		len = plan->chunk_size;
+	slot->hole = !extent->physical;
+	slot->pos = (u64)extent->physical * block_size + (plan->offset - (u64)extent->logical * block_size);
+	slot->len = len;
+	slot->err = 0;
+	plan->offset += len;
+	return 1;
+}
+
+/*** io_uring engine ***/
+
+static int uring_setup(struct aio_uring *ring, u32 entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring->sq_ptr = ring->cq_ptr = ring->sqes = MAP_FAILED;
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto err_uring_setup;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			goto err_uring_setup;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_uring_setup;
+	u8 *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+	ring->sq_head = (u32 *)(sq + p.sq_off.head);
+	ring->sq_tail = (u32 *)(sq + p.sq_off.tail);
+	ring->sq_mask = (u32 *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (u32 *)(sq + p.sq_off.array);
+	ring->cq_head = (u32 *)(cq + p.cq_off.head);
+	ring->cq_tail = (u32 *)(cq + p.cq_off.tail);
+	ring->cq_mask = (u32 *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+err_uring_setup:
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr != MAP_FAILED)
+		munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+	return -1;
+}
+
+static void uring_free(struct aio_uring *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+static int uring_submit(struct aio *aio, u32 index) {
+	struct aio_uring *ring = &aio->uring;
+	struct aio_slot *slot = &aio->slots[index];
+	u32 tail = *ring->sq_tail;
+	u32 sq_index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[sq_index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = aio->ext2->fd;
+	sqe->addr = (u64)(uintptr_t)slot->buf;
+	sqe->len = slot->len;
+	sqe->off = slot->pos;
+	sqe->user_data = index;
+	ring->sq_array[sq_index] = sq_index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	EXT2_STATS_SYSCALL(aio->ext2);
+	if (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) != 1) {
+		errno = ERR_FS_IO;
+		return -1;
+	}
+	return 0;
+}
+
+static int uring_wait(struct aio *aio, u32 index) {
+	struct aio_uring *ring = &aio->uring;
+	while (aio->slots[index].state != SLOT_DONE) {
+		u32 head = *ring->cq_head;
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			EXT2_STATS_SYSCALL(aio->ext2);
+			if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+				errno = ERR_FS_IO;
+				return -1;
+			}
+			continue;
+		}
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		struct aio_slot *slot = &aio->slots[cqe->user_data];
+		slot->err = cqe->res == (int)slot->len ? 0 : cqe->res < 0 ? -cqe->res : EIO;
+		slot->state = SLOT_DONE;
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+static int uring_read_support; /* 1 yes, -1 no, 0 not probed yet */
+
+static int uring_probe(struct aio *aio) {
+	/*** Returns 1 if ring can do IORING_OP_READ, 0 if not, -1 and sets errno on error ***/
+	int known = __atomic_load_n(&uring_read_support, __ATOMIC_RELAXED);
+	if (known)
+		return known > 0;
+	struct aio_slot *slot = &aio->slots[0];
+	u8 *buf = slot->buf;
+	slot->buf = aio->probe;
+	slot->pos = 0;
+	slot->len = sizeof(aio->probe);
+	slot->state = SLOT_PENDING;
+	int res = uring_submit(aio, 0) || uring_wait(aio, 0);
+	slot->buf = buf;
+	if (res)
+		return -1;
+	slot->state = SLOT_FREE;
+	int supported = slot->err != EINVAL && slot->err != EOPNOTSUPP;
+	if (supported && slot->err) {
+		errno = ERR_FS_IO;
+		return -1;
+	}
+	__atomic_store_n(&uring_read_support, supported ? 1 : -1, __ATOMIC_RELAXED);
+	return supported;
+}
+
+/*** pread thread pool engine ***/
+
+static void *pool_worker(void *arg) {
+	struct aio *aio = arg;
+	struct aio_threads *pool = &aio->pool;
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop) {
+		struct aio_slot *slot = NULL;
+		for (u32 i = 0; i < aio->depth; ++i) {
+			if (aio->slots[i].state == SLOT_PENDING) {
+				slot = &aio->slots[i];
+				break;
+			}
+		}
+		if (!slot) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+			continue;
+		}
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&pool->lock);
+		EXT2_STATS_SYSCALL(aio->ext2);
+		ssize_t res = pread(aio->ext2->fd, slot->buf, slot->len, slot->pos);
+		pthread_mutex_lock(&pool->lock);
+		slot->err = res == (ssize_t)slot->len ? 0 : res < 0 ? errno : EIO;
+		slot->state = SLOT_DONE;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static int pool_setup(struct aio *aio, u32 nr_threads) {
+	struct aio_threads *pool = &aio->pool;
+	pool->stop = 0;
+	pool->nr_threads = 0;
+	pool->threads = malloc(nr_threads * sizeof(*pool->threads));
+	if (!pool->threads)
+		return -1;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (; pool->nr_threads < nr_threads; ++pool->nr_threads)
+		if (pthread_create(&pool->threads[pool->nr_threads], NULL, pool_worker, aio))
+			break;
+	return pool->nr_threads ? 0 : -1;
+}
+
+static void pool_free(struct aio *aio) {
+	struct aio_threads *pool = &aio->pool;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (u32 i = 0; i < pool->nr_threads; ++i)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+}
+
+static int pool_submit(struct aio *aio, u32 index) {
+	struct aio_threads *pool = &aio->pool;
+	pthread_mutex_lock(&pool->lock);
+	aio->slots[index].state = SLOT_PENDING;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+static int pool_wait(struct aio *aio, u32 index) {
+	struct aio_threads *pool = &aio->pool;
+	pthread_mutex_lock(&pool->lock);
+	while (aio->slots[index].state != SLOT_DONE)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+/*** Engine independent part ***/
+
+static int aio_submit(struct aio *aio, u32 index) {
+	struct aio_slot *slot = &aio->slots[index];
+	if (slot->hole) {
+		memset(slot->buf, 0, slot->len);
+		if (aio->engine == EXT2_AIO_URING) {
+			slot->state = SLOT_DONE;
+			return 0;
+		}
+		/*** Pool workers scan states under the lock ***/
+		pthread_mutex_lock(&aio->pool.lock);
+		slot->state = SLOT_DONE;
+		pthread_mutex_unlock(&aio->pool.lock);
+		return 0;
+	}
+	if (aio->engine == EXT2_AIO_URING) {
+		slot->state = SLOT_PENDING;
+		return uring_submit(aio, index);
+	}
+	return pool_submit(aio, index);
+}
+
+static int aio_wait(struct aio *aio, u32 index) {
+	if (aio->engine == EXT2_AIO_URING)
+		return uring_wait(aio, index);
+	return pool_wait(aio, index);
+}
+
+static int aio_setup(struct aio *aio, const struct ext2_aio_opts *opts) {
+	aio->engine = opts->engine;
+	if (aio->engine != EXT2_AIO_THREADS) {
+		if (!uring_setup(&aio->uring, aio->depth)) {
+			aio->engine = EXT2_AIO_URING;
+			int supported = uring_probe(aio);
+			if (supported > 0)
+				return 0;
+			uring_free(&aio->uring);
+			if (supported < 0)
+				return -1;
+			errno = EOPNOTSUPP;
+			aio->engine = opts->engine;
+		}
+		if (aio->engine == EXT2_AIO_URING)
+			return -1;
+	}
+	aio->engine = EXT2_AIO_THREADS;
+	return pool_setup(aio, opts->threads ? opts->threads : aio->depth);
+}
+
+static void aio_free(struct aio *aio) {
+	if (aio->engine == EXT2_AIO_URING)
+		uring_free(&aio->uring);
+	else
+		pool_free(aio);
+}
+
+static int aio_drain(struct aio *aio, u32 *in_flight) {
+	/*** Wait for every submitted read before buffers go away ***/
+	for (u32 i = 0; i < aio->depth; ++i) {
+		if (in_flight[i] && aio_wait(aio, i))
+			return -1;
+		in_flight[i] = 0;
+	}
+	return 0;
+}
+
+int ext2_aio_read(const struct ext2 *ext2, u32 ino, const struct ext2_aio_opts *opts, ext2_aio_consume_t consume, void *arg) {
+	struct ext2_aio_opts defaults = { EXT2_AIO_AUTO, EXT2_AIO_DEFAULT_DEPTH, EXT2_AIO_DEFAULT_CHUNK, 0 };
+	if (!opts)
+		opts = &defaults;
+	size_t chunk_size = opts->chunk_size ? opts->chunk_size : EXT2_AIO_DEFAULT_CHUNK;
+	if (chunk_size > UINT32_MAX) { /*** Slot length is u32 ***/
+		errno = EINVAL;
+		return -1;
+	}
+	int res;
+	struct ext2_inode inode;
+	struct ext2_extent_map map;
+	res = read_inode(ext2, &inode, ino);
+	if (res)
+		return res;
+	res = ext2_inode_extents(ext2, &inode, &map);
+	if (res)
+		return res;
+	struct aio aio;
+	aio.ext2 = ext2;
+	aio.depth = opts->queue_depth ? opts->queue_depth : EXT2_AIO_DEFAULT_DEPTH;
+	struct aio_plan plan = { ext2, &map, ext2_inode_size(&inode), 0, 0, chunk_size };
+	aio.slots = calloc(aio.depth, sizeof(*aio.slots));
+	u32 *in_flight = calloc(aio.depth, sizeof(u32));
+	u8 *mem = ext2_pool_alloc(aio.depth * chunk_size);
+	res = -1;
+	if (!aio.slots || !in_flight || !mem)
+		goto out_ext2_aio_read;
+	for (u32 i = 0; i < aio.depth; ++i)
+		aio.slots[i].buf = mem + i * chunk_size;
+	if (aio_setup(&aio, opts))
+		goto out_ext2_aio_read;
+	/*** Fill the queue ***/
+	u32 queued = 0;
+	for (; queued < aio.depth; ++queued) {
+		int planned = plan_next(&plan, &aio.slots[queued]);
+		if (planned < 0)
+			goto out_drain;
+		if (!planned)
+			break;
+		if (aio_submit(&aio, queued))
+			goto out_drain;
+		in_flight[queued] = 1;
+	}
+	/*** Hand chunks out in order and refill freed slots ***/
+	for (u32 head = 0; queued; head = (head + 1) % aio.depth) {
+		struct aio_slot *slot = &aio.slots[head];
+		if (aio_wait(&aio, head))
+			goto out_drain;
+		in_flight[head] = 0;
+		queued--;
+		if (slot->err) {
+			errno = ERR_FS_IO;
+			goto out_drain;
+		}
+		if (consume(arg, slot->buf, slot->len))
+			goto out_drain;
+		int planned = plan_next(&plan, slot);
+		if (planned < 0)
+			goto out_drain;
+		if (planned) {
+			if (aio_submit(&aio, head))
+				goto out_drain;
+			in_flight[head] = 1;
+			queued++;
+		}
+	}
+	res = 0;
+out_drain:
+	aio_drain(&aio, in_flight);
+	aio_free(&aio);
+out_ext2_aio_read:
+	ext2_pool_free(mem);
+	free(in_flight);
+	free(aio.slots);
+	ext2_extent_map_free(&map);
+	return res;
+}
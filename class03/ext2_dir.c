@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "ext2.h"
+
+/*** Directory iterator ***/
+
+int ext2_dir_iter_new(struct ext2_dir_iter *iter, const struct ext2 *ext2, u32 ino) {
+	int res;
+	iter->block = NULL;
+	iter->block_index = 0;
+	iter->offset = 0;
+	res = ext2_inode_blocks_iter_new(&iter->blocks, ext2, ino);
+	if (res)
+		return res;
+	if (!ISDIR(iter->blocks.ino.i_mode)) {
+		errno = ERR_FS_NOT_DIR;
+		return -1;
+	}
+	iter->nblocks = iter->blocks.map.count ? iter->blocks.map.extents[iter->blocks.map.count - 1].logical + iter->blocks.map.extents[iter->blocks.map.count - 1].len : 0;
+	return 0;
+}
+
+static int dir_iter_next_block(struct ext2_dir_iter *iter) {
+	/*** Returns 0 at the end of directory ***/
+	const struct ext2 *ext2 = iter->blocks.ext2;
+	ext2_brelse(ext2, iter->block);
+	iter->block = NULL;
+	while (iter->block_index < iter->nblocks) {
+		u32 block_no = ext2_extent_map_lookup(&iter->blocks.map, iter->block_index++);
+		if (!block_no) /*** Holes hold no entries ***/
+			continue;
+		iter->block = ext2_bread(ext2, block_no);
+		if (!iter->block)
+			return -1;
+		iter->offset = 0;
+		return 1;
+	}
+	return 0;
+}
+
+static int dir_entry_parse(const struct ext2 *ext2, const u8 *data, u32 offset, struct ext2_dirent *dirent) {
+	/*** Fills dirent from entry at offset, -1 with ERR_FS_CORRUPT on bad entry ***/
+	u32 blocksize = ext2->blocksize;
+	struct ext2_dir_entry_2 entry_on_disk;
+	/*** Header must fit in the rest of block before it is read ***/
+	if (offset > blocksize || blocksize - offset < sizeof(entry_on_disk)) {
+		errno = ERR_FS_CORRUPT;
+		return -1;
+	}
+	memcpy(&entry_on_disk, data + offset, sizeof(entry_on_disk));
+	u32 rec_len = le16toh(entry_on_disk.rec_len);
+	if (blocksize == EXT2_MAX_BLOCK_SIZE && (rec_len == 0 || rec_len == EXT2_MAX_BLOCK_SIZE - 1))
+		rec_len = EXT2_MAX_BLOCK_SIZE; /*** Whole 64K block doesn't fit le16 ***/
+	/*** Without filetype high byte of name_len is there instead of file_type ***/
+	u32 name_len = entry_on_disk.name_len;
+	u8 file_type = EXT2_FT_UNKNOWN;
+	if (ext2->feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE)
+		file_type = entry_on_disk.file_type < EXT2_FT_MAX ? entry_on_disk.file_type : EXT2_FT_UNKNOWN;
+	else
+		name_len |= (u32)entry_on_disk.file_type << 8;
+	/*** Bad rec_len would loop forever or run out of block ***/
+	if (rec_len < sizeof(entry_on_disk) || rec_len % 4 || rec_len > blocksize - offset ||
+			name_len > EXT2_NAME_LEN || name_len > rec_len - sizeof(entry_on_disk)) {
+		errno = ERR_FS_CORRUPT;
+		return -1;
+	}
+	dirent->inode = le32toh(entry_on_disk.inode);
+	dirent->rec_len = rec_len;
+	dirent->name_len = name_len;
+	dirent->file_type = file_type;
+	dirent->name = (const char *)data + offset + sizeof(entry_on_disk);
+	return 0;
+}
+
+int ext2_dir_iter_next(struct ext2_dir_iter *iter, struct ext2_dirent *dirent) {
+	u32 blocksize = iter->blocks.ext2->blocksize;
+	for (;;) {
+		if (!iter->block || iter->offset == blocksize) {
+			int res = dir_iter_next_block(iter);
+			if (res <= 0)
+				return res;
+		}
+		if (dir_entry_parse(iter->blocks.ext2, iter->block->data, iter->offset, dirent))
+			return -1;
+		iter->offset += dirent->rec_len;
+		if (dirent->inode) /*** Skip unused entries ***/
+			return 1;
+	}
+}
+
+u64 ext2_dir_iter_tell(const struct ext2_dir_iter *iter) {
+	u32 blocksize = iter->blocks.ext2->blocksize;
+	if (!iter->block) /*** Nothing read yet or past the end ***/
+		return (u64)iter->block_index * blocksize;
+	return (u64)(iter->block_index - 1) * blocksize + iter->offset;
+}
+
+int ext2_dir_iter_seek(struct ext2_dir_iter *iter, u64 pos) {
+	u32 blocksize = iter->blocks.ext2->blocksize;
+	if (pos % 4) { /*** Entries are 4 byte aligned ***/
+		errno = EINVAL;
+		return -1;
+	}
+	ext2_brelse(iter->blocks.ext2, iter->block);
+	iter->block = NULL;
+	iter->offset = 0;
+	if (pos / blocksize >= iter->nblocks) {
+		iter->block_index = iter->nblocks;
+		return 0;
+	}
+	iter->block_index = pos / blocksize;
+	if (pos % blocksize == 0)
+		return 0;
+	if (dir_iter_next_block(iter) < 0)
+		return -1;
+	/*** Hole holds no entries, next one starts at the beginning of a block ***/
+	if (iter->block && iter->block_index == pos / blocksize + 1)
+		iter->offset = pos % blocksize;
+	return 0;
+}
+
+int ext2_dir_block_find(const struct ext2 *ext2, u32 block_no, const char *name, size_t name_len) {
+	struct ext2_dirent dirent;
+	struct ext2_block *block = ext2_bread(ext2, block_no);
+	if (!block)
+		return -1;
+	int res = 0;
+	for (u32 offset = 0; offset < ext2->blocksize; offset += dirent.rec_len) {
+		if (dir_entry_parse(ext2, block->data, offset, &dirent)) {
+			res = -1;
+			break;
+		}
+		if (dirent.inode && dirent.name_len == name_len && !memcmp(dirent.name, name, name_len)) {
+			res = dirent.inode;
+			break;
+		}
+	}
+	ext2_brelse(ext2, block);
+	return res;
+}
+
+void ext2_dir_iter_end(struct ext2_dir_iter *iter) {
+	ext2_brelse(iter->blocks.ext2, iter->block);
+	iter->block = NULL;
+	ext2_inode_blocks_iter_end(&iter->blocks);
+}
+
+int get_ino_in_dir_by_name(const struct ext2 *ext2, const u32 inode_number, const char *req_name, size_t name_len) {
+	/*** Returns inode number of file in directory ***/
+	/*** Zero if not found and negative number on error ***/
+	EXT2_STATS_START(start);
+	int res;
+	struct ext2_dir_iter iter;
+	struct ext2_dirent dirent;
+	res = ext2_dir_iter_new(&iter, ext2, inode_number);
+	if (res)
+		goto out_get_ino_in_dir_by_name;
+	if ((iter.blocks.ino.i_flags & EXT2_INDEX_FL) && (ext2->feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+		res = ext2_htree_lookup(&iter.blocks, req_name, name_len);
+		if (res >= 0 || errno != ERR_FS_CORRUPT)
+			goto out_get_ino_in_dir_by_name;
+		/*** Broken index, entries are still readable as linear directory ***/
+	}
+	while ((res = ext2_dir_iter_next(&iter, &dirent)) > 0) {
+		if (dirent.name_len == name_len && !memcmp(dirent.name, req_name, name_len)) {
+			res = dirent.inode;
+			break;
+		}
+	}
+out_get_ino_in_dir_by_name:
+	ext2_dir_iter_end(&iter);
+	if (res >= 0)
+		EXT2_STATS_RECORD(ext2, EXT2_STAT_LOOKUP, start, 0);
+	return res;
+}
+
+/*** Dentry cache ***/
+
+static u32 dentry_hash(u32 parent, const char *name, size_t name_len) {
+	/*** FNV-1a over parent inode and name ***/
+	u32 hash = 2166136261u;
+	for (int i = 0; i < 4; ++i)
+		hash = (hash ^ ((parent >> (8 * i)) & 0xff)) * 16777619u;
+	for (size_t i = 0; i < name_len; ++i)
+		hash = (hash ^ (u8)name[i]) * 16777619u;
+	return hash;
+}
+
+static size_t dentry_size(const struct ext2_dentry *dentry) {
+	return sizeof(*dentry) + dentry->name_len;
+}
+
+int ext2_dcache_init(struct ext2 *ext2, size_t budget) {
+	struct ext2_dcache *dcache = calloc(1, sizeof(*dcache));
+	ext2->dcache = dcache;
+	if (!dcache)
+		return -1;
+	/*** One bucket per average sized entry ***/
+	u32 hash_size = 1;
+	while (hash_size < budget / (sizeof(struct ext2_dentry) + 16))
+		hash_size <<= 1;
+	dcache->hash = calloc(hash_size, sizeof(*dcache->hash));
+	if (!dcache->hash)
+		return -1;
+	pthread_mutex_init(&dcache->lock, NULL);
+	dcache->hash_mask = hash_size - 1;
+	dcache->budget = budget;
+	return 0;
+}
+
+void ext2_dcache_free(struct ext2_dcache *dcache) {
+	if (!dcache)
+		return;
+	struct ext2_dentry *dentry = dcache->lru_head;
+	while (dentry) {
+		struct ext2_dentry *next = dentry->lru_next;
+		free(dentry);
+		dentry = next;
+	}
+	pthread_mutex_destroy(&dcache->lock);
+	free(dcache->hash);
+	free(dcache);
+}
+
+static void dcache_lru_unlink(struct ext2_dcache *dcache, struct ext2_dentry *dentry) {
+	if (dentry->lru_prev)
+		dentry->lru_prev->lru_next = dentry->lru_next;
+	else
+		dcache->lru_head = dentry->lru_next;
+	if (dentry->lru_next)
+		dentry->lru_next->lru_prev = dentry->lru_prev;
+	else
+		dcache->lru_tail = dentry->lru_prev;
+}
+
+static void dcache_lru_push(struct ext2_dcache *dcache, struct ext2_dentry *dentry) {
+	dentry->lru_prev = NULL;
+	dentry->lru_next = dcache->lru_head;
+	if (dcache->lru_head)
+		dcache->lru_head->lru_prev = dentry;
+	else
+		dcache->lru_tail = dentry;
+	dcache->lru_head = dentry;
+}
+
+static void dcache_evict(struct ext2_dcache *dcache) {
+	/*** Drop least recently used entries until cache fits budget ***/
+	while (dcache->used > dcache->budget && dcache->lru_tail) {
+		struct ext2_dentry *dentry = dcache->lru_tail;
+		struct ext2_dentry **p = &dcache->hash[dentry->hash & dcache->hash_mask];
+		for (; *p; p = &(*p)->hash_next) {
+			if (*p == dentry) {
+				*p = dentry->hash_next;
+				break;
+			}
+		}
+		dcache_lru_unlink(dcache, dentry);
+		dcache->used -= dentry_size(dentry);
+		free(dentry);
+	}
+}
+
+static struct ext2_dentry *dcache_find(struct ext2_dcache *dcache, u32 parent, u32 hash, const char *name, size_t name_len) {
+	struct ext2_dentry *dentry = dcache->hash[hash & dcache->hash_mask];
+	for (; dentry; dentry = dentry->hash_next)
+		if (dentry->hash == hash && dentry->parent == parent && dentry->name_len == name_len && !memcmp(dentry->name, name, name_len))
+			return dentry;
+	return NULL;
+}
+
+static void dcache_add(struct ext2_dcache *dcache, u32 parent, u32 hash, const char *name, size_t name_len, u32 ino) {
+	/*** Out of memory only means the entry is not cached ***/
+	struct ext2_dentry *dentry = malloc(sizeof(*dentry) + name_len);
+	if (!dentry)
+		return;
+	dentry->parent = parent;
+	dentry->ino = ino;
+	dentry->hash = hash;
+	dentry->name_len = name_len;
+	memcpy(dentry->name, name, name_len);
+	struct ext2_dentry **bucket = &dcache->hash[hash & dcache->hash_mask];
+	dentry->hash_next = *bucket;
+	*bucket = dentry;
+	dcache_lru_push(dcache, dentry);
+	dcache->used += dentry_size(dentry);
+	dcache_evict(dcache);
+}
+
+void ext2_dcache_stats(const struct ext2 *ext2, u64 *hits, u64 *misses) {
+	*hits = ext2->dcache->hits;
+	*misses = ext2->dcache->misses;
+}
+
+/*** Lookups ***/
+
+int ext2_lookup(const struct ext2 *ext2, u32 dir_ino, const char *name, size_t name_len) {
+	/*** Returns inode number, zero if not found and negative number on error ***/
+	struct ext2_dcache *dcache = ext2->dcache;
+	if (name_len > EXT2_NAME_LEN)
+		return 0;
+	u32 hash = dentry_hash(dir_ino, name, name_len);
+	pthread_mutex_lock(&dcache->lock);
+	struct ext2_dentry *dentry = dcache_find(dcache, dir_ino, hash, name, name_len);
+	if (dentry) {
+		dcache->hits++;
+		dcache_lru_unlink(dcache, dentry);
+		dcache_lru_push(dcache, dentry);
+		int ino = dentry->ino;
+		pthread_mutex_unlock(&dcache->lock);
+		return ino;
+	}
+	dcache->misses++;
+	pthread_mutex_unlock(&dcache->lock);
+	/*** Directory is scanned unlocked, racing threads may scan it twice ***/
+	int res = get_ino_in_dir_by_name(ext2, dir_ino, name, name_len);
+	if (res >= 0) { /*** Not found is cached as negative entry ***/
+		pthread_mutex_lock(&dcache->lock);
+		if (!dcache_find(dcache, dir_ino, hash, name, name_len))
+			dcache_add(dcache, dir_ino, hash, name, name_len, res);
+		pthread_mutex_unlock(&dcache->lock);
+	}
+	return res;
+}
+
+int ext2_lookup_path(const struct ext2 *ext2, const char *path) {
+	/*** Returns inode number or -1 and sets errno ***/
+	/*** Components are separated by any number of '/', path starts at root ***/
+	int ino = EXT2_ROOT_INO;
+	const char *p = path;
+	while (*p) {
+		while (*p == '/')
+			p++;
+		const char *name = p;
+		while (*p && *p != '/')
+			p++;
+		if (p == name)
+			break;
+		ino = ext2_lookup(ext2, ino, name, p - name);
+		if (ino < 0)
+			return -1;
+		if (ino == 0) {
+			errno = ERR_FS_NOT_FOUND;
+			return -1;
+		}
+	}
+	return ino;
+}
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+#include "ext2.h"
+
+/*******************
+ * Copying inode data from image to a host fd.
+ * Every extent is moved by the kernel: copy_file_range when both fds allow it
+ * (reflink or in-kernel copy), sendfile otherwise (pipes, sockets), and a plain
+ * write as the last resort, straight from the mapping for EXT2_IO_MMAP.
+ * Holes are skipped with lseek so the output stays sparse; fds that can't seek
+ * get zeros.
+ ******************/
+
+#define EXTRACT_COPY_RANGE	0
+#define EXTRACT_SENDFILE	1
+#define EXTRACT_WRITE		2
+
+struct extract {
+	const struct ext2 *ext2;
+	int out_fd;
+	int method;		/* EXTRACT_*, only goes down to slower ones */
+	int seekable;
+	int hole_at_end;	/* Output has to be extended by ftruncate */
+	u8 *buf;		/* For EXTRACT_WRITE without mapping */
+};
+
+static const u8 extract_zeros[64 << 10];
+
+static int extract_write_all(int fd, const void *buf, size_t len) {
+	const u8 *p = buf;
+	while (len) {
+		ssize_t res = write(fd, p, len);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static int extract_fallback(int err) {
+	/*** Errors meaning this pair of fds can't use the method ***/
+	return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+}
+
+static int extract_write(struct extract *extract, u64 pos, u64 len) {
+	const struct ext2 *ext2 = extract->ext2;
+	while (len) {
+		size_t n = len < EXT2_EXTRACT_BUF_SIZE ? len : EXT2_EXTRACT_BUF_SIZE;
+		const void *data = ext2->io->map(ext2, pos, n);
+		if (!data) {
+			if (!extract->buf) {
+				extract->buf = ext2_pool_alloc(EXT2_EXTRACT_BUF_SIZE);
+				if (!extract->buf)
+					return -1;
+			}
+			if (ext2_io_read(ext2, extract->buf, n, pos))
+				return -1;
+			data = extract->buf;
+		}
+		EXT2_STATS_SYSCALL(ext2);
+		if (extract_write_all(extract->out_fd, data, n))
+			return -1;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int extract_data(struct extract *extract, u64 pos, u64 len) {
+	/*** Copies len bytes at image offset pos ***/
+	const struct ext2 *ext2 = extract->ext2;
+	if (ext2->image_size && pos + len > ext2->image_size) {
+		errno = ERR_FS_IO;
+		return -1;
+	}
+	ext2_io_advise(ext2, pos, len, EXT2_ADVICE_SEQUENTIAL);
+	while (len && extract->method != EXTRACT_WRITE) {
+		ssize_t res;
+		loff_t in_off = pos;
+		EXT2_STATS_SYSCALL(ext2);
+		if (extract->method == EXTRACT_COPY_RANGE)
+			res = copy_file_range(ext2->fd, &in_off, extract->out_fd, NULL, len, 0);
+		else
+			res = sendfile(extract->out_fd, ext2->fd, &in_off, len);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!extract_fallback(errno))
+				return -1;
+			extract->method++;
+			continue;
+		}
+		if (res == 0) { /*** Image is shorter than it claims ***/
+			errno = ERR_FS_IO;
+			return -1;
+		}
+		pos += res;
+		len -= res;
+	}
+	return len ? extract_write(extract, pos, len) : 0;
+}
+
+static int extract_hole(struct extract *extract, u64 len) {
+	if (extract->seekable) {
+		if (lseek(extract->out_fd, len, SEEK_CUR) >= 0) {
+			extract->hole_at_end = 1;
+			return 0;
+		}
+		if (errno != ESPIPE)
+			return -1;
+		extract->seekable = 0;
+	}
+	while (len) {
+		size_t n = len < sizeof(extract_zeros) ? len : sizeof(extract_zeros);
+		if (extract_write_all(extract->out_fd, extract_zeros, n))
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+int ext2_extract_map(const struct ext2 *ext2, const struct ext2_extent_map *map, u64 size, int out_fd) {
+	/*** Returns 0, or -1 and sets errno ***/
+	int res = 0;
+	struct extract extract = { ext2, out_fd, EXTRACT_COPY_RANGE, 1, 0, NULL };
+	u64 offset = 0;
+	for (u32 i = 0; i < map->count && offset < size && !res; ++i) {
+		const struct ext2_extent *extent = &map->extents[i];
+		u64 end = (u64)(extent->logical + extent->len) * ext2->blocksize;
+		if (end > size)
+			end = size;
+		if (extent->physical) {
+			extract.hole_at_end = 0;
+			res = extract_data(&extract, (u64)extent->physical * ext2->blocksize, end - offset);
+		} else {
+			res = extract_hole(&extract, end - offset);
+		}
+		offset = end;
+	}
+	/*** Blocks past the last mapped one are a hole as well ***/
+	if (!res && offset < size)
+		res = extract_hole(&extract, size - offset);
+	if (!res && extract.hole_at_end) {
+		off_t end = lseek(out_fd, 0, SEEK_CUR);
+		res = end < 0 || ftruncate(out_fd, end) ? -1 : 0;
+	}
+	ext2_pool_free(extract.buf);
+	return res;
+}
+
+int ext2_extract(const struct ext2 *ext2, u32 ino, int out_fd) {
+	/*** Returns 0, or -1 and sets errno ***/
+	int res;
+	struct ext2_inode inode;
+	struct ext2_extent_map map;
+	res = read_inode(ext2, &inode, ino);
+	if (res)
+		return res;
+	res = ext2_inode_extents(ext2, &inode, &map);
+	if (res)
+		return res;
+	res = ext2_extract_map(ext2, &map, ext2_inode_size(&inode), out_fd);
+	ext2_extent_map_free(&map);
+	return res;
+}
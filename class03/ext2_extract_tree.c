@@ -0,0 +1,539 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "ext2.h"
+
+/*******************
+ * Mirroring a subtree of the image onto host fs as a pipeline of three stages.
+ * Walkers (ext2_walk_from) create directories at once and collect files and
+ * symlinks into batches. One planner builds extent maps of each batch and sorts
+ * it by first physical block. Writers take runs of neighbouring jobs from the
+ * sorted batches, so the image is read mostly forward, and small files go in
+ * groups that share one queue access and one parent directory fd.
+ * Queues are bounded, a slow stage stalls the one before it.
+ ******************/
+
+#define TREE_BATCH		4096	/* Jobs sorted together */
+#define TREE_QUEUE		4	/* Batches waiting in each queue */
+#define TREE_SLICE_FILES	64	/* Jobs taken by writer at once */
+#define TREE_SLICE_BYTES	(1 << 20)
+
+struct tree_job {
+	char *path;		/* Relative to host_dir */
+	u32 ino;
+	struct ext2_inode inode;
+	struct ext2_extent_map map;
+	u32 first_block;	/* Sort key, 0 when nothing to read */
+};
+
+struct tree_batch {
+	struct tree_batch *next;
+	struct tree_job *jobs;
+	u32 count;
+	u32 head;		/* Next job for writers */
+};
+
+struct tree_queue {
+	struct tree_batch *head, *tail;
+	u32 length;
+	int closed;		/* No more batches will come */
+};
+
+struct extract_tree {
+	const struct ext2 *ext2;
+	int root_fd;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;	/* Some queue changed or error */
+	struct tree_batch *filling;	/* Walkers append here */
+	struct tree_queue walked;	/* Walkers to planner */
+	struct tree_queue planned;	/* Planner to writers */
+	int err;		/* errno of first failure */
+	u64 dirs, files, symlinks, bytes;
+};
+
+/*** Queues, called with tree->lock held ***/
+
+static void tree_fail(struct extract_tree *tree, int err) {
+	if (!tree->err)
+		tree->err = err ? err : ERR_FS_IO;
+	pthread_cond_broadcast(&tree->changed);
+}
+
+static void tree_batch_free(struct tree_batch *batch) {
+	for (u32 i = batch->head; i < batch->count; ++i) {
+		free(batch->jobs[i].path);
+		ext2_extent_map_free(&batch->jobs[i].map);
+	}
+	free(batch->jobs);
+	free(batch);
+}
+
+static int queue_push(struct extract_tree *tree, struct tree_queue *queue, struct tree_batch *batch) {
+	while (queue->length >= TREE_QUEUE && !tree->err)
+		pthread_cond_wait(&tree->changed, &tree->lock);
+	if (tree->err) {
+		tree_batch_free(batch);
+		return -1;
+	}
+	batch->next = NULL;
+	if (queue->tail)
+		queue->tail->next = batch;
+	else
+		queue->head = batch;
+	queue->tail = batch;
+	queue->length++;
+	pthread_cond_broadcast(&tree->changed);
+	return 0;
+}
+
+static struct tree_batch *queue_head(struct extract_tree *tree, struct tree_queue *queue) {
+	/*** Waits for a batch, NULL when queue is closed and empty or on error ***/
+	while (!queue->head && !queue->closed && !tree->err)
+		pthread_cond_wait(&tree->changed, &tree->lock);
+	return tree->err ? NULL : queue->head;
+}
+
+static void queue_pop(struct extract_tree *tree, struct tree_queue *queue) {
+	queue->head = queue->head->next;
+	if (!queue->head)
+		queue->tail = NULL;
+	queue->length--;
+	pthread_cond_broadcast(&tree->changed);
+}
+
+static void queue_close(struct extract_tree *tree, struct tree_queue *queue) {
+	queue->closed = 1;
+	pthread_cond_broadcast(&tree->changed);
+}
+
+/*** Walk stage ***/
+
+static const char *tree_relative(const char *path) {
+	/*** Walk paths start with '/', root of subtree is "/" ***/
+	return path[1] ? path + 1 : ".";
+}
+
+static int tree_path_valid(const char *rel) {
+	/*** Components of a path from the image may not climb out of host_dir ***/
+	if (!strcmp(rel, "."))
+		return 1;
+	for (const char *p = rel;; ++p) {
+		size_t len = strcspn(p, "/");
+		if (!len || (p[0] == '.' && (len == 1 || (len == 2 && p[1] == '.'))))
+			return 0;
+		p += len;
+		if (!*p)
+			return 1;
+	}
+}
+
+static int openat2_support = 1; /* Cleared when kernel has no openat2 */
+
+static int tree_open_dir(int root_fd, const char *dir) {
+	/*** Opens directory below root_fd, symlinks and ".." are never followed ***/
+	if (__atomic_load_n(&openat2_support, __ATOMIC_RELAXED)) {
+		struct open_how how = {
+			.flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC,
+			.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS,
+		};
+		int fd = syscall(SYS_openat2, root_fd, dir, &how, sizeof(how));
+		if (fd >= 0 || errno != ENOSYS)
+			return fd;
+		__atomic_store_n(&openat2_support, 0, __ATOMIC_RELAXED);
+	}
+	/*** Older kernels: one component at a time ***/
+	int fd = root_fd;
+	for (const char *p = dir; *p;) {
+		char name[EXT2_NAME_LEN + 1];
+		size_t len = strcspn(p, "/");
+		if (len > EXT2_NAME_LEN) {
+			errno = ENAMETOOLONG;
+			goto err_tree_open_dir;
+		}
+		memcpy(name, p, len);
+		name[len] = '\0';
+		int next = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (next < 0)
+			goto err_tree_open_dir;
+		if (fd != root_fd)
+			close(fd);
+		fd = next;
+		p += len;
+		if (*p)
+			++p;
+	}
+	return fd == root_fd ? dup(root_fd) : fd;
+err_tree_open_dir:
+	if (fd != root_fd) {
+		int err = errno;
+		close(fd);
+		errno = err;
+	}
+	return -1;
+}
+
+static int tree_mkdir(struct extract_tree *tree, const char *rel, u32 mode) {
+	/*** Name is made relative to its parent, so a symlink in place of the parent fails ***/
+	const char *slash = strrchr(rel, '/');
+	if (!slash)
+		return mkdirat(tree->root_fd, rel, mode);
+	char *dir = strndup(rel, slash - rel);
+	if (!dir)
+		return -1;
+	int dir_fd = tree_open_dir(tree->root_fd, dir);
+	free(dir);
+	if (dir_fd < 0)
+		return -1;
+	int res = mkdirat(dir_fd, slash + 1, mode);
+	int err = errno;
+	close(dir_fd);
+	errno = err;
+	return res;
+}
+
+static int tree_add_job(struct extract_tree *tree, const char *path, u32 ino, const struct ext2_inode *inode) {
+	struct tree_job job = { strdup(tree_relative(path)), ino, *inode, { NULL, 0, 0 }, 0 };
+	if (!job.path)
+		return -1;
+	int res = 0;
+	pthread_mutex_lock(&tree->lock);
+	struct tree_batch *batch = tree->filling;
+	if (!batch) {
+		batch = calloc(1, sizeof(*batch));
+		if (batch)
+			batch->jobs = malloc(TREE_BATCH * sizeof(*batch->jobs));
+		if (!batch || !batch->jobs) {
+			free(batch);
+			free(job.path);
+			pthread_mutex_unlock(&tree->lock);
+			return -1;
+		}
+		tree->filling = batch;
+	}
+	batch->jobs[batch->count++] = job;
+	if (batch->count == TREE_BATCH) {
+		tree->filling = NULL;
+		res = queue_push(tree, &tree->walked, batch);
+	}
+	pthread_mutex_unlock(&tree->lock);
+	return res;
+}
+
+static int tree_walk_cb(void *arg, const char *path, u32 ino, const struct ext2_inode *inode) {
+	struct extract_tree *tree = arg;
+	if (__atomic_load_n(&tree->err, __ATOMIC_RELAXED))
+		return 1;
+	int res = 0;
+	if (!tree_path_valid(tree_relative(path))) {
+		errno = ERR_FS_CORRUPT;
+		res = -1;
+	} else if (ISDIR(inode->i_mode)) {
+		/*** Parent is made before its entries are read, children always find it ***/
+		res = tree_mkdir(tree, tree_relative(path), (inode->i_mode & 07777) | 0700);
+		if (res && errno == EEXIST)
+			res = 0;
+		if (!res)
+			__atomic_add_fetch(&tree->dirs, 1, __ATOMIC_RELAXED);
+	} else if (IFREG(inode->i_mode) || ISLNK(inode->i_mode)) {
+		res = tree_add_job(tree, path, ino, inode);
+	}
+	if (res) {
+		pthread_mutex_lock(&tree->lock);
+		tree_fail(tree, errno);
+		pthread_mutex_unlock(&tree->lock);
+		return 1;
+	}
+	return 0;
+}
+
+/*** Plan stage ***/
+
+static int tree_fast_symlink(const struct ext2 *ext2, const struct ext2_inode *inode) {
+	/*** Target kept in i_block when no data block is allocated ***/
+	u32 acl_sectors = inode->i_file_acl ? ext2->blocksize / 512 : 0;
+	return ISLNK(inode->i_mode) && inode->i_blocks == acl_sectors;
+}
+
+static int tree_job_cmp(const void *a, const void *b) {
+	const struct tree_job *x = a, *y = b;
+	return x->first_block < y->first_block ? -1 : x->first_block > y->first_block;
+}
+
+static int tree_plan(const struct ext2 *ext2, struct tree_batch *batch) {
+	for (u32 i = 0; i < batch->count; ++i) {
+		struct tree_job *job = &batch->jobs[i];
+		if (tree_fast_symlink(ext2, &job->inode))
+			continue;
+		if (ext2_inode_extents(ext2, &job->inode, &job->map))
+			return -1;
+		for (u32 e = 0; e < job->map.count && !job->first_block; ++e)
+			job->first_block = job->map.extents[e].physical;
+	}
+	qsort(batch->jobs, batch->count, sizeof(*batch->jobs), tree_job_cmp);
+	return 0;
+}
+
+static void *tree_planner(void *arg) {
+	struct extract_tree *tree = arg;
+	pthread_mutex_lock(&tree->lock);
+	struct tree_batch *batch;
+	while ((batch = queue_head(tree, &tree->walked))) {
+		queue_pop(tree, &tree->walked);
+		pthread_mutex_unlock(&tree->lock);
+		int res = tree_plan(tree->ext2, batch);
+		int err = errno;
+		pthread_mutex_lock(&tree->lock);
+		if (res) {
+			tree_batch_free(batch);
+			tree_fail(tree, err);
+			break;
+		}
+		if (queue_push(tree, &tree->planned, batch))
+			break;
+	}
+	queue_close(tree, &tree->planned);
+	pthread_mutex_unlock(&tree->lock);
+	return NULL;
+}
+
+/*** Write stage ***/
+
+struct tree_writer {
+	struct extract_tree *tree;
+	pthread_t thread;
+	struct tree_job jobs[TREE_SLICE_FILES];
+	u32 count;
+	int dir_fd;		/* Parent directory of last job */
+	char *dir;		/* Its path */
+	size_t dir_len;
+};
+
+static int tree_take_slice(struct tree_writer *writer) {
+	/*** Moves a run of neighbouring jobs to writer, 0 when all work is done ***/
+	struct extract_tree *tree = writer->tree;
+	u64 bytes = 0;
+	writer->count = 0;
+	pthread_mutex_lock(&tree->lock);
+	struct tree_batch *batch = queue_head(tree, &tree->planned);
+	while (batch && writer->count < TREE_SLICE_FILES && bytes < TREE_SLICE_BYTES) {
+		struct tree_job *job = &batch->jobs[batch->head++];
+		bytes += ext2_inode_size(&job->inode);
+		writer->jobs[writer->count++] = *job;
+		if (batch->head == batch->count) {
+			queue_pop(tree, &tree->planned);
+			tree_batch_free(batch);
+			batch = tree->planned.head;
+		}
+	}
+	pthread_mutex_unlock(&tree->lock);
+	return writer->count;
+}
+
+static int tree_parent_fd(struct tree_writer *writer, const char *path, const char **name) {
+	/*** Directory fd for openat, reused while jobs stay in one directory ***/
+	const char *slash = strrchr(path, '/');
+	size_t len = slash ? (size_t)(slash - path) : 0;
+	*name = slash ? slash + 1 : path;
+	if (!slash)
+		return writer->tree->root_fd;
+	if (writer->dir_fd >= 0 && writer->dir_len == len && !memcmp(writer->dir, path, len))
+		return writer->dir_fd;
+	if (writer->dir_fd >= 0)
+		close(writer->dir_fd);
+	writer->dir_fd = -1;
+	char *dir = realloc(writer->dir, len + 1);
+	if (!dir)
+		return -1;
+	writer->dir = dir;
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+	writer->dir_len = len;
+	writer->dir_fd = tree_open_dir(writer->tree->root_fd, dir);
+	return writer->dir_fd;
+}
+
+static int tree_write_symlink(struct tree_writer *writer, struct tree_job *job, int dir_fd, const char *name) {
+	const struct ext2 *ext2 = writer->tree->ext2;
+	int fast = tree_fast_symlink(ext2, &job->inode);
+	u32 len = job->inode.i_size;
+	u32 block_no = job->map.count ? job->map.extents[0].physical : 0;
+	if (fast ? len >= sizeof(job->inode.i_block) : len >= ext2->blocksize || !block_no) {
+		errno = ERR_FS_CORRUPT;
+		return -1;
+	}
+	char *target = malloc(len + 1);
+	if (!target)
+		return -1;
+	int res = 0;
+	if (fast) {
+		memcpy(target, job->inode.i_block, len);
+	} else {
+		struct ext2_block *block = ext2_bread(ext2, block_no);
+		if (!block) {
+			free(target);
+			return -1;
+		}
+		memcpy(target, block->data, len);
+		ext2_brelse(ext2, block);
+	}
+	target[len] = '\0';
+	if (symlinkat(target, dir_fd, name) && errno != EEXIST)
+		res = -1;
+	free(target);
+	if (!res)
+		__atomic_add_fetch(&writer->tree->symlinks, 1, __ATOMIC_RELAXED);
+	return res;
+}
+
+static int tree_write_file(struct tree_writer *writer, struct tree_job *job, int dir_fd, const char *name) {
+	struct extract_tree *tree = writer->tree;
+	int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, job->inode.i_mode & 07777);
+	if (fd < 0)
+		return -1;
+	int res = ext2_extract_map(tree->ext2, &job->map, ext2_inode_size(&job->inode), fd);
+	if (!res) {
+		struct timespec times[2] = { { job->inode.i_atime, 0 }, { job->inode.i_mtime, 0 } };
+		res = futimens(fd, times);
+	}
+	int err = errno;
+	close(fd);
+	errno = err;
+	if (res)
+		return -1;
+	__atomic_add_fetch(&tree->files, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&tree->bytes, ext2_inode_size(&job->inode), __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void *tree_writer(void *arg) {
+	struct tree_writer *writer = arg;
+	struct extract_tree *tree = writer->tree;
+	while (tree_take_slice(writer)) {
+		int res = 0;
+		for (u32 i = 0; i < writer->count; ++i) {
+			struct tree_job *job = &writer->jobs[i];
+			const char *name;
+			if (!res && !__atomic_load_n(&tree->err, __ATOMIC_RELAXED)) {
+				int dir_fd = tree_parent_fd(writer, job->path, &name);
+				if (dir_fd < 0)
+					res = -1;
+				else if (ISLNK(job->inode.i_mode))
+					res = tree_write_symlink(writer, job, dir_fd, name);
+				else
+					res = tree_write_file(writer, job, dir_fd, name);
+			}
+			free(job->path);
+			ext2_extent_map_free(&job->map);
+		}
+		if (res) {
+			pthread_mutex_lock(&tree->lock);
+			tree_fail(tree, errno);
+			pthread_mutex_unlock(&tree->lock);
+		}
+	}
+	return NULL;
+}
+
+static double tree_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int ext2_extract_tree(const struct ext2 *ext2, const char *path, const char *host_dir, u32 nr_threads, struct ext2_extract_stats *stats) {
+	/*** Returns 0, or -1 and sets errno ***/
+	double start = tree_now();
+	if (!nr_threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = cpus > 0 ? cpus : 1;
+	}
+	int ino = ext2_lookup_path(ext2, path);
+	if (ino < 0)
+		return -1;
+	if (mkdir(host_dir, 0755) && errno != EEXIST)
+		return -1;
+	struct extract_tree tree;
+	memset(&tree, 0, sizeof(tree));
+	tree.ext2 = ext2;
+	tree.root_fd = open(host_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (tree.root_fd < 0)
+		return -1;
+	struct tree_writer *writers = calloc(nr_threads, sizeof(*writers));
+	if (!writers) {
+		close(tree.root_fd);
+		return -1;
+	}
+	pthread_mutex_init(&tree.lock, NULL);
+	pthread_cond_init(&tree.changed, NULL);
+	pthread_t planner;
+	int planner_started = !pthread_create(&planner, NULL, tree_planner, &tree);
+	u32 started = 0;
+	for (; planner_started && started < nr_threads; ++started) {
+		writers[started].tree = &tree;
+		writers[started].dir_fd = -1;
+		if (pthread_create(&writers[started].thread, NULL, tree_writer, &writers[started]))
+			break;
+	}
+	if (!planner_started || !started) {
+		pthread_mutex_lock(&tree.lock);
+		tree_fail(&tree, EAGAIN);
+		pthread_mutex_unlock(&tree.lock);
+	} else if (ext2_walk_from(ext2, ino, nr_threads, tree_walk_cb, &tree, NULL)) {
+		pthread_mutex_lock(&tree.lock);
+		tree_fail(&tree, errno);
+		pthread_mutex_unlock(&tree.lock);
+	}
+	/*** Last partial batch, then let stages drain ***/
+	pthread_mutex_lock(&tree.lock);
+	if (tree.filling && !tree.err)
+		queue_push(&tree, &tree.walked, tree.filling);
+	else if (tree.filling)
+		tree_batch_free(tree.filling);
+	tree.filling = NULL;
+	queue_close(&tree, &tree.walked);
+	if (!planner_started)
+		queue_close(&tree, &tree.planned);
+	pthread_mutex_unlock(&tree.lock);
+	if (planner_started)
+		pthread_join(planner, NULL);
+	for (u32 i = 0; i < started; ++i) {
+		pthread_join(writers[i].thread, NULL);
+		if (writers[i].dir_fd >= 0)
+			close(writers[i].dir_fd);
+		free(writers[i].dir);
+	}
+	free(writers);
+	/*** Batches left over after error ***/
+	struct tree_queue *queues[2] = { &tree.walked, &tree.planned };
+	for (int i = 0; i < 2; ++i) {
+		while (queues[i]->head) {
+			struct tree_batch *batch = queues[i]->head;
+			queues[i]->head = batch->next;
+			tree_batch_free(batch);
+		}
+	}
+	pthread_cond_destroy(&tree.changed);
+	pthread_mutex_destroy(&tree.lock);
+	close(tree.root_fd);
+	if (stats) {
+		stats->dirs = tree.dirs;
+		stats->files = tree.files;
+		stats->symlinks = tree.symlinks;
+		stats->bytes = tree.bytes;
+		stats->seconds = tree_now() - start;
+	}
+	if (tree.err) {
+		errno = tree.err;
+		return -1;
+	}
+	return 0;
+}
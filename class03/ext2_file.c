@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ext2.h"
+
+/*******************
+ * Random access to inode data.
+ * File block is turned into a path through the indirect tree by arithmetic:
+ * direct, then one, two or three levels, so any offset costs at most three
+ * metadata reads. Decoded indirect blocks are kept in a few per-file slots
+ * (least recently used goes first), nearby reads in one subtree don't even take
+ * the block cache lock. Blocks that follow each other on disk are read with one
+ * backend read.
+ ******************/
+
+int ext2_file_open(struct ext2_file *file, const struct ext2 *ext2, u32 ino) {
+	/*** Returns 0, or -1 and sets errno ***/
+	int res;
+	file->ext2 = ext2;
+	file->ino = ino;
+	file->tick = 0;
+	file->maps = NULL;
+	res = read_inode(ext2, &file->inode, ino);
+	if (res)
+		return res;
+	file->size = ext2_inode_size(&file->inode);
+	u32 per_block = ext2->blocksize / sizeof(u32);
+	file->maps = ext2_pool_alloc((size_t)EXT2_FILE_CACHE_SLOTS * per_block * sizeof(u32));
+	if (!file->maps)
+		return -1;
+	for (int i = 0; i < EXT2_FILE_CACHE_SLOTS; ++i) {
+		file->cache[i].block_no = 0;
+		file->cache[i].last_used = 0;
+	}
+	return 0;
+}
+
+static const u32 *file_indirect(struct ext2_file *file, u32 block_no) {
+	/*** Decoded indirect block through per-file slots, NULL and errno on error ***/
+	u32 per_block = file->ext2->blocksize / sizeof(u32);
+	int victim = 0;
+	file->tick++;
+	for (int i = 0; i < EXT2_FILE_CACHE_SLOTS; ++i) {
+		if (file->cache[i].block_no == block_no) {
+			file->cache[i].last_used = file->tick;
+			return file->maps + (size_t)i * per_block;
+		}
+		if (file->cache[i].last_used < file->cache[victim].last_used)
+			victim = i;
+	}
+	u32 *map = file->maps + (size_t)victim * per_block;
+	file->cache[victim].block_no = 0;
+	if (ext2_read_block_map(file->ext2, block_no, map))
+		return NULL;
+	file->cache[victim].block_no = block_no;
+	file->cache[victim].last_used = file->tick;
+	return map;
+}
+
+int ext2_file_bmap(struct ext2_file *file, u32 logical, u32 *physical) {
+	/*** Returns 0, or -1 and sets errno ***/
+	u32 per_block = file->ext2->blocksize / sizeof(u32);
+	u32 index[3];
+	int depth;
+	if (logical < EXT2_NDIR_BLOCKS) {
+		*physical = file->inode.i_block[logical];
+		return 0;
+	}
+	logical -= EXT2_NDIR_BLOCKS;
+	u64 span = per_block;
+	for (depth = 1; depth <= 3 && logical >= span; ++depth) {
+		logical -= span;
+		span *= per_block;
+	}
+	if (depth > 3) {
+		errno = EFBIG;
+		return -1;
+	}
+	/*** Index in each level, top level first ***/
+	for (int i = depth - 1; i >= 0; --i) {
+		index[i] = logical % per_block;
+		logical /= per_block;
+	}
+	u32 block_no = file->inode.i_block[EXT2_IND_BLOCK + depth - 1];
+	for (int i = 0; i < depth && block_no; ++i) {
+		const u32 *map = file_indirect(file, block_no);
+		if (!map)
+			return -1;
+		block_no = map[index[i]];
+	}
+	*physical = block_no;
+	return 0;
+}
+
+ssize_t ext2_file_pread(struct ext2_file *file, void *buf, size_t len, u64 offset) {
+	/*** Returns number of read bytes, 0 at the end of file, or -1 and sets errno ***/
+	const struct ext2 *ext2 = file->ext2;
+	u32 block_size = ext2->blocksize;
+	if (offset >= file->size)
+		return 0;
+	if (len > file->size - offset)
+		len = file->size - offset;
+	u8 *p = buf;
+	size_t done = 0;
+	while (done < len) {
+		/*** Run of blocks that are adjacent on disk or all holes ***/
+		u64 pos = offset + done;
+		u32 logical = pos / block_size;
+		u32 first;
+		if (ext2_file_bmap(file, logical, &first))
+			return -1;
+		size_t run = block_size - pos % block_size;
+		while (done + run < len) {
+			u32 next;
+			if (ext2_file_bmap(file, ++logical, &next))
+				return -1;
+			if (first ? next != first + (logical - pos / block_size) : next != 0)
+				break;
+			run += block_size;
+		}
+		if (run > len - done)
+			run = len - done;
+		if (first) {
+			if (ext2_io_read(ext2, p + done, run, (u64)first * block_size + pos % block_size))
+				return -1;
+		} else {
+			memset(p + done, 0, run);
+		}
+		done += run;
+	}
+	return done;
+}
+
+int ext2_file_close(struct ext2_file *file) {
+	ext2_pool_free(file->maps);
+	file->maps = NULL;
+	return 0;
+}
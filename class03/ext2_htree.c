@@ -0,0 +1,311 @@
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "ext2.h"
+
+/*******************
+ * Read-only lookup in HTree (dir_index) directories.
+ * Block 0 of directory is dx_root: fake "." and ".." entries, dx_root_info and
+ * index entries. Interior blocks are dx_node: one empty entry over the whole block
+ * and index entries. Every index entry is (hash, logical block), first entry
+ * holds limit and count instead of hash. Leaves are plain directory blocks.
+ ******************/
+
+#define DX_HASH_LEGACY				0
+#define DX_HASH_HALF_MD4			1
+#define DX_HASH_TEA					2
+#define DX_HASH_LEGACY_UNSIGNED		3
+#define DX_HASH_HALF_MD4_UNSIGNED	4
+#define DX_HASH_TEA_UNSIGNED		5
+
+#define DX_MAX_LEVELS		3 /* Root and up to two levels of dx_node */
+#define DX_BLOCK_MASK		0x0fffffff
+#define DX_ROOT_INFO_OFFSET	24 /* After fake "." and ".." entries */
+#define DX_NODE_OFFSET		8 /* After fake empty entry */
+
+struct dx_root_info {
+	__le32	reserved_zero;
+	__u8	hash_version;
+	__u8	info_length;	/* 8 */
+	__u8	indirect_levels;
+	__u8	unused_flags;
+};
+
+struct dx_entry {
+	__le32	hash;
+	__le32	block;
+};
+
+struct dx_countlimit {
+	__le16	limit;
+	__le16	count;
+};
+
+struct dx_frame {
+	struct ext2_block *block;
+	const struct dx_entry *entries;
+	u32 count;
+	u32 at;			/* Entry we descended through */
+};
+
+/*** Hashes, same as in Linux fs/ext4/hash.c ***/
+
+static u32 rol32(u32 x, int s) {
+	return (x << s) | (x >> (32 - s));
+}
+
+static void tea_transform(u32 buf[4], const u32 in[4]) {
+	u32 sum = 0;
+	u32 b0 = buf[0], b1 = buf[1];
+	u32 a = in[0], b = in[1], c = in[2], d = in[3];
+	for (int n = 0; n < 16; ++n) {
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = rol32(a, s))
+#define K1 0
+#define K2 013240474631U
+#define K3 015666365641U
+
+static void half_md4_transform(u32 buf[4], const u32 in[8]) {
+	u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+	/*** Round 1 ***/
+	ROUND(F, a, b, c, d, in[0] + K1, 3);
+	ROUND(F, d, a, b, c, in[1] + K1, 7);
+	ROUND(F, c, d, a, b, in[2] + K1, 11);
+	ROUND(F, b, c, d, a, in[3] + K1, 19);
+	ROUND(F, a, b, c, d, in[4] + K1, 3);
+	ROUND(F, d, a, b, c, in[5] + K1, 7);
+	ROUND(F, c, d, a, b, in[6] + K1, 11);
+	ROUND(F, b, c, d, a, in[7] + K1, 19);
+	/*** Round 2 ***/
+	ROUND(G, a, b, c, d, in[1] + K2, 3);
+	ROUND(G, d, a, b, c, in[3] + K2, 5);
+	ROUND(G, c, d, a, b, in[5] + K2, 9);
+	ROUND(G, b, c, d, a, in[7] + K2, 13);
+	ROUND(G, a, b, c, d, in[0] + K2, 3);
+	ROUND(G, d, a, b, c, in[2] + K2, 5);
+	ROUND(G, c, d, a, b, in[4] + K2, 9);
+	ROUND(G, b, c, d, a, in[6] + K2, 13);
+	/*** Round 3 ***/
+	ROUND(H, a, b, c, d, in[3] + K3, 3);
+	ROUND(H, d, a, b, c, in[7] + K3, 9);
+	ROUND(H, c, d, a, b, in[2] + K3, 11);
+	ROUND(H, b, c, d, a, in[6] + K3, 15);
+	ROUND(H, a, b, c, d, in[1] + K3, 3);
+	ROUND(H, d, a, b, c, in[5] + K3, 9);
+	ROUND(H, c, d, a, b, in[0] + K3, 11);
+	ROUND(H, b, c, d, a, in[4] + K3, 15);
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+static u32 dx_hack_hash(const char *name, int len, int is_unsigned) {
+	u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	for (int i = 0; i < len; ++i) {
+		int c = is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+		hash = hash1 + (hash0 ^ (u32)(c * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+static void str2hashbuf(const char *msg, int len, u32 *buf, int num, int is_unsigned) {
+	u32 pad = (u32)len | ((u32)len << 8);
+	pad |= pad << 16;
+	u32 val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (int i = 0; i < len; ++i) {
+		int c = is_unsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+		val = c + (val << 8);
+		if (i % 4 == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+static int dx_hash(const struct ext2 *ext2, int version, const char *name, int len, u32 *hash) {
+	u32 buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	u32 in[8];
+	if (ext2->hash_seed[0] || ext2->hash_seed[1] || ext2->hash_seed[2] || ext2->hash_seed[3])
+		memcpy(buf, ext2->hash_seed, sizeof(buf));
+	int is_unsigned = version >= DX_HASH_LEGACY_UNSIGNED;
+	switch (version) {
+	case DX_HASH_LEGACY:
+	case DX_HASH_LEGACY_UNSIGNED:
+		*hash = dx_hack_hash(name, len, is_unsigned);
+		break;
+	case DX_HASH_HALF_MD4:
+	case DX_HASH_HALF_MD4_UNSIGNED:
+		for (const char *p = name; len > 0; len -= 32, p += 32) {
+			str2hashbuf(p, len, in, 8, is_unsigned);
+			half_md4_transform(buf, in);
+		}
+		*hash = buf[1];
+		break;
+	case DX_HASH_TEA:
+	case DX_HASH_TEA_UNSIGNED:
+		for (const char *p = name; len > 0; len -= 16, p += 16) {
+			str2hashbuf(p, len, in, 4, is_unsigned);
+			tea_transform(buf, in);
+		}
+		*hash = buf[0];
+		break;
+	default:
+		errno = ERR_FS_CORRUPT;
+		return -1;
+	}
+	*hash &= ~1u;
+	if (*hash == 0x7fffffffu << 1)
+		*hash = 0x7ffffffeu << 1;
+	return 0;
+}
+
+/*** Index walking ***/
+
+static int dx_frame_load(const struct ext2_inode_blocks_iter *dir, struct dx_frame *frame, u32 logical, u32 offset) {
+	/*** Reads index block and its entries starting at offset ***/
+	const struct ext2 *ext2 = dir->ext2;
+	u32 block_no = ext2_extent_map_lookup(&dir->map, logical);
+	if (!block_no) {
+		errno = ERR_FS_CORRUPT;
+		return -1;
+	}
+	frame->block = ext2_bread(ext2, block_no);
+	if (!frame->block)
+		return -1;
+	struct dx_countlimit countlimit;
+	memcpy(&countlimit, frame->block->data + offset, sizeof(countlimit));
+	u32 limit = le16toh(countlimit.limit);
+	frame->count = le16toh(countlimit.count);
+	frame->entries = (const struct dx_entry *)(frame->block->data + offset);
+	frame->at = 0;
+	if (!frame->count || frame->count > limit || offset + limit * sizeof(struct dx_entry) > ext2->blocksize) {
+		errno = ERR_FS_CORRUPT;
+		return -1;
+	}
+	return 0;
+}
+
+static u32 dx_get_hash(const struct dx_frame *frame, u32 i) {
+	return i ? le32toh(frame->entries[i].hash) : 0;
+}
+
+static u32 dx_get_block(const struct dx_frame *frame, u32 i) {
+	return le32toh(frame->entries[i].block) & DX_BLOCK_MASK;
+}
+
+static void dx_search(struct dx_frame *frame, u32 hash) {
+	/*** Last entry with hash not greater than wanted ***/
+	u32 lo = 1, hi = frame->count;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (dx_get_hash(frame, mid) > hash)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	frame->at = lo - 1;
+}
+
+static int dx_next_leaf(const struct ext2_inode_blocks_iter *dir, struct dx_frame *frames, int levels, u32 hash) {
+	/*** Steps to next leaf if its entries may share our hash, returns 0 otherwise ***/
+	int level = levels - 1;
+	while (++frames[level].at == frames[level].count) {
+		if (level == 0)
+			return 0;
+		level--;
+	}
+	if ((dx_get_hash(&frames[level], frames[level].at) & ~1u) != hash)
+		return 0;
+	for (; level < levels - 1; ++level) {
+		ext2_brelse(dir->ext2, frames[level + 1].block);
+		frames[level + 1].block = NULL;
+		if (dx_frame_load(dir, &frames[level + 1], dx_get_block(&frames[level], frames[level].at), DX_NODE_OFFSET))
+			return -1;
+	}
+	return 1;
+}
+
+int ext2_htree_lookup(const struct ext2_inode_blocks_iter *dir, const char *name, size_t name_len) {
+	/*** Returns inode number, zero if not found and negative number on error ***/
+	const struct ext2 *ext2 = dir->ext2;
+	struct dx_frame frames[DX_MAX_LEVELS];
+	int levels = 0;
+	int res = -1;
+	u32 hash;
+	memset(frames, 0, sizeof(frames));
+	/*** Root ***/
+	u32 root_no = ext2_extent_map_lookup(&dir->map, 0);
+	if (!root_no) {
+		errno = ERR_FS_CORRUPT;
+		return -1;
+	}
+	struct ext2_block *root = ext2_bread(ext2, root_no);
+	if (!root)
+		return -1;
+	struct dx_root_info info;
+	memcpy(&info, root->data + DX_ROOT_INFO_OFFSET, sizeof(info));
+	ext2_brelse(ext2, root);
+	if (info.reserved_zero || info.indirect_levels >= DX_MAX_LEVELS || info.info_length < sizeof(info)) {
+		errno = ERR_FS_CORRUPT;
+		return -1;
+	}
+	int version = info.hash_version;
+	if (version <= DX_HASH_TEA)
+		version += ext2->hash_unsigned;
+	if (dx_hash(ext2, version, name, name_len, &hash))
+		return -1;
+	/*** Descend to leaf ***/
+	for (; levels <= info.indirect_levels; ++levels) {
+		struct dx_frame *frame = &frames[levels];
+		if (levels == 0)
+			res = dx_frame_load(dir, frame, 0, DX_ROOT_INFO_OFFSET + info.info_length);
+		else
+			res = dx_frame_load(dir, frame, dx_get_block(frame - 1, frame[-1].at), DX_NODE_OFFSET);
+		if (res) {
+			levels++;
+			goto out_ext2_htree_lookup;
+		}
+		dx_search(frame, hash);
+	}
+	/*** Scan leaf, continue to next leaves while hash collides ***/
+	do {
+		struct dx_frame *frame = &frames[levels - 1];
+		u32 block_no = ext2_extent_map_lookup(&dir->map, dx_get_block(frame, frame->at));
+		if (!block_no) {
+			errno = ERR_FS_CORRUPT;
+			res = -1;
+			break;
+		}
+		res = ext2_dir_block_find(ext2, block_no, name, name_len);
+		if (res)
+			break;
+		res = dx_next_leaf(dir, frames, levels, hash);
+	} while (res > 0);
+out_ext2_htree_lookup:
+	for (int i = 0; i < levels; ++i)
+		ext2_brelse(ext2, frames[i].block);
+	return res;
+}
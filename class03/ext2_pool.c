@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ext2.h"
+
+/*******************
+ * Thread-local pools of buffers for iterators, extent maps and read buffers.
+ * Sizes are rounded up to power of two classes, every thread keeps a few free
+ * buffers of each class, so a lookup or read that runs again allocates nothing
+ * and threads never share a free list. A buffer may be put back by another
+ * thread, it just moves to that thread's pool. Bigger sizes go to malloc.
+ * Pools are freed when their thread exits.
+ ******************/
+
+#define POOL_MIN_SHIFT		6	/* Smallest class is 64 bytes */
+#define POOL_CLASSES		16	/* Up to 2 MiB */
+#define POOL_DEPTH		8	/* Free buffers kept per class */
+#define POOL_HEADER		16	/* Keeps malloc alignment */
+#define POOL_BIG		0xff	/* Class of buffers that bypass pool */
+
+struct pool {
+	void *free[POOL_CLASSES][POOL_DEPTH];
+	u8 count[POOL_CLASSES];
+	u64 hits;
+	u64 misses;
+};
+
+static __thread struct pool *thread_pool;
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_destroy(void *arg) {
+	struct pool *pool = arg;
+	for (int c = 0; c < POOL_CLASSES; ++c)
+		for (int i = 0; i < pool->count[c]; ++i)
+			free(pool->free[c][i]);
+	free(pool);
+}
+
+static void pool_key_init(void) {
+	pthread_key_create(&pool_key, pool_destroy);
+}
+
+static struct pool *pool_get(void) {
+	/*** NULL only if pool can't be made, callers then use malloc ***/
+	if (thread_pool)
+		return thread_pool;
+	pthread_once(&pool_once, pool_key_init);
+	struct pool *pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	if (pthread_setspecific(pool_key, pool)) {
+		free(pool);
+		return NULL;
+	}
+	thread_pool = pool;
+	return pool;
+}
+
+static int pool_class(size_t size) {
+	int c = 0;
+	while (c < POOL_CLASSES && ((size_t)1 << (c + POOL_MIN_SHIFT)) < size)
+		c++;
+	return c < POOL_CLASSES ? c : POOL_BIG;
+}
+
+void *ext2_pool_alloc(size_t size) {
+	/*** Returns NULL and sets errno on error ***/
+	int c = pool_class(size);
+	struct pool *pool = pool_get();
+	u8 *p = NULL;
+	if (c != POOL_BIG && pool && pool->count[c]) {
+		p = pool->free[c][--pool->count[c]];
+		pool->hits++;
+	} else {
+		p = malloc(POOL_HEADER + (c == POOL_BIG ? size : (size_t)1 << (c + POOL_MIN_SHIFT)));
+		if (!p)
+			return NULL;
+		if (pool)
+			pool->misses++;
+		p[0] = c;
+	}
+	return p + POOL_HEADER;
+}
+
+void *ext2_pool_realloc(void *ptr, size_t old_size, size_t size) {
+	/*** Keeps buffer when its class is big enough, old_size bytes are copied ***/
+	if (ptr && pool_class(size) != POOL_BIG && pool_class(size) <= ((u8 *)ptr - POOL_HEADER)[0])
+		return ptr;
+	void *p = ext2_pool_alloc(size);
+	if (!p)
+		return NULL;
+	if (ptr) {
+		memcpy(p, ptr, old_size < size ? old_size : size);
+		ext2_pool_free(ptr);
+	}
+	return p;
+}
+
+void ext2_pool_free(void *ptr) {
+	if (!ptr)
+		return;
+	u8 *p = (u8 *)ptr - POOL_HEADER;
+	int c = p[0];
+	struct pool *pool = c != POOL_BIG ? pool_get() : NULL;
+	if (pool && pool->count[c] < POOL_DEPTH) {
+		pool->free[c][pool->count[c]++] = p;
+		return;
+	}
+	free(p);
+}
+
+void ext2_pool_stats(u64 *hits, u64 *misses) {
+	struct pool *pool = thread_pool;
+	*hits = pool ? pool->hits : 0;
+	*misses = pool ? pool->misses : 0;
+}
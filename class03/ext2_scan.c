@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "ext2.h"
+
+/*******************
+ * Streaming every inode of every group.
+ * Each batch is one read of consecutive inodes from a group's inode table,
+ * s_inode_size apart, so larger inodes are stepped over correctly.
+ * Decoding goes field by field into plain arrays that callers loop over.
+ ******************/
+
+int ext2_inode_scan_new(struct ext2_inode_scan *scan, const struct ext2 *ext2, u32 batch_size) {
+	if (!batch_size)
+		batch_size = EXT2_SCAN_DEFAULT_BATCH;
+	if (batch_size > ext2->inodes_per_group)
+		batch_size = ext2->inodes_per_group;
+	scan->ext2 = ext2;
+	scan->group = 0;
+	scan->end_group = ext2->groups_count;
+	scan->index = 0;
+	scan->batch_size = batch_size;
+	scan->buf = NULL;
+	struct ext2_inode_batch *batch = &scan->batch;
+	size_t per_inode = sizeof(u64) + 4 * sizeof(u16) + (5 + EXT2_N_BLOCKS) * sizeof(u32);
+	u8 *mem = malloc(batch_size * per_inode);
+	if (!mem)
+		return -1;
+	/*** Widest field first keeps every array aligned ***/
+	batch->size = (u64 *)mem;
+	batch->mtime = (u32 *)(batch->size + batch_size);
+	batch->dtime = batch->mtime + batch_size;
+	batch->blocks = batch->dtime + batch_size;
+	batch->flags = batch->blocks + batch_size;
+	batch->file_acl = batch->flags + batch_size;
+	batch->block = batch->file_acl + batch_size;
+	batch->mode = (u16 *)(batch->block + batch_size * EXT2_N_BLOCKS);
+	batch->uid = batch->mode + batch_size;
+	batch->gid = batch->uid + batch_size;
+	batch->links_count = batch->gid + batch_size;
+	batch->count = 0;
+	if (!ext2->map) {
+		scan->buf = malloc((size_t)batch_size * ext2->inode_size);
+		if (!scan->buf) {
+			free(mem);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void scan_decode(struct ext2_inode_batch *batch, const u8 *raw, u32 stride) {
+#define RAW(i) ((const struct ext2_inode *)(raw + (size_t)(i) * stride))
+	u32 n = batch->count;
+	for (u32 i = 0; i < n; ++i)
+		batch->mode[i] = le16toh(RAW(i)->i_mode);
+	for (u32 i = 0; i < n; ++i)
+		batch->uid[i] = le16toh(RAW(i)->i_uid);
+	for (u32 i = 0; i < n; ++i)
+		batch->gid[i] = le16toh(RAW(i)->i_gid);
+	for (u32 i = 0; i < n; ++i)
+		batch->links_count[i] = le16toh(RAW(i)->i_links_count);
+	for (u32 i = 0; i < n; ++i)
+		batch->size[i] = le32toh(RAW(i)->i_size) |
+			(IFREG(batch->mode[i]) ? (u64)le32toh(RAW(i)->i_dir_acl) << 32 : 0);
+	for (u32 i = 0; i < n; ++i)
+		batch->mtime[i] = le32toh(RAW(i)->i_mtime);
+	for (u32 i = 0; i < n; ++i)
+		batch->dtime[i] = le32toh(RAW(i)->i_dtime);
+	for (u32 i = 0; i < n; ++i)
+		batch->blocks[i] = le32toh(RAW(i)->i_blocks);
+	for (u32 i = 0; i < n; ++i)
+		batch->flags[i] = le32toh(RAW(i)->i_flags);
+	for (u32 i = 0; i < n; ++i)
+		batch->file_acl[i] = le32toh(RAW(i)->i_file_acl);
+	for (u32 i = 0; i < n; ++i)
+		ext2_le32_to_cpu_array(batch->block + (size_t)i * EXT2_N_BLOCKS, RAW(i)->i_block, EXT2_N_BLOCKS);
+#undef RAW
+}
+
+void ext2_inode_scan_range(struct ext2_inode_scan *scan, u32 first_group, u32 end_group) {
+	scan->group = first_group;
+	scan->end_group = end_group < scan->ext2->groups_count ? end_group : scan->ext2->groups_count;
+	scan->index = 0;
+}
+
+int ext2_inode_scan_next(struct ext2_inode_scan *scan) {
+	const struct ext2 *ext2 = scan->ext2;
+	struct ext2_inode_batch *batch = &scan->batch;
+	if (scan->index == ext2->inodes_per_group) {
+		scan->group++;
+		scan->index = 0;
+	}
+	if (scan->group >= scan->end_group)
+		return 0;
+	u32 n = ext2->inodes_per_group - scan->index;
+	if (n > scan->batch_size)
+		n = scan->batch_size;
+	u64 table = (u64)ext2->groups.inode_table[scan->group] * ext2->blocksize;
+	u64 offset = table + (u64)scan->index * ext2->inode_size;
+	size_t len = (size_t)n * ext2->inode_size;
+	if (scan->index == 0) /*** Whole table is read in order ***/
+		ext2_io_advise(ext2, table, (u64)ext2->inodes_per_group * ext2->inode_size, EXT2_ADVICE_SEQUENTIAL);
+	const u8 *raw;
+	if (ext2->map) {
+		raw = ext2->io->map(ext2, offset, len);
+		if (!raw)
+			return -1;
+	} else {
+		if (ext2_io_read(ext2, scan->buf, len, offset))
+			return -1;
+		raw = scan->buf;
+	}
+	batch->first_ino = scan->group * ext2->inodes_per_group + scan->index + 1;
+	batch->count = n;
+	scan_decode(batch, raw, ext2->inode_size);
+	scan->index += n;
+	return n;
+}
+
+void ext2_inode_scan_end(struct ext2_inode_scan *scan) {
+	free(scan->batch.size);
+	free(scan->buf);
+}
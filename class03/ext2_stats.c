@@ -0,0 +1,233 @@
+#ifdef EXT2_STATS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ext2.h"
+
+/*******************
+ * Hot path counters and latency histograms.
+ * Every thread gets its own block of counters for every ext2 it touches, only
+ * that thread writes it, so recording is a few relaxed stores and no shared
+ * cache line moves. Blocks stay on the ext2 after their thread exits, readers
+ * sum all of them. Threads find their blocks through a small thread-local
+ * table keyed by id of the ext2 stats, ids are never reused so a stale entry
+ * for a closed image can't match a new one. A thread that misses the table
+ * looks its block up on the list by thread id before making one, so threads
+ * cycling through many images keep one block per image.
+ * Histograms are log-linear like HDR histograms: a bucket per 1/8 of every
+ * power of two of nanoseconds, so any value is off by at most 12.5%.
+ * Built only with -DEXT2_STATS, without it the hooks are empty macros.
+ ******************/
+
+#define STATS_SUB			(1 << EXT2_STATS_SUB_BITS)
+#define STATS_THREAD_SLOTS	8 /* Images a thread records to without taking the lock */
+
+struct stats_thread {
+	struct stats_thread *next;
+	pthread_t owner;	/* Block of exited thread goes to next thread with its id */
+	struct ext2_stats_snapshot counters;
+};
+
+struct ext2_stats {
+	u64 id;
+	pthread_mutex_t lock;	/* Protects list of threads */
+	struct stats_thread *threads;
+};
+
+static u64 stats_next_id = 1;
+
+static __thread struct {
+	u64 id;
+	struct stats_thread *thread;
+} stats_slots[STATS_THREAD_SLOTS];
+static __thread u32 stats_victim;
+
+static const char *stats_names[EXT2_STAT_OPS] = {
+	[EXT2_STAT_OPEN] = "open",
+	[EXT2_STAT_READ_INODE] = "read_inode",
+	[EXT2_STAT_LOOKUP] = "lookup",
+	[EXT2_STAT_ITER_NEXT] = "iter_next",
+	[EXT2_STAT_IO_READ] = "io_read",
+};
+
+int ext2_stats_init(struct ext2 *ext2) {
+	/*** Returns 0, or -1 and sets errno ***/
+	struct ext2_stats *stats = calloc(1, sizeof(*stats));
+	if (!stats)
+		return -1;
+	stats->id = __atomic_fetch_add(&stats_next_id, 1, __ATOMIC_RELAXED);
+	pthread_mutex_init(&stats->lock, NULL);
+	ext2->stats = stats;
+	return 0;
+}
+
+void ext2_stats_free(struct ext2_stats *stats) {
+	if (!stats)
+		return;
+	struct stats_thread *thread = stats->threads;
+	while (thread) {
+		struct stats_thread *next = thread->next;
+		free(thread);
+		thread = next;
+	}
+	pthread_mutex_destroy(&stats->lock);
+	free(stats);
+}
+
+u64 ext2_stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct ext2_stats_snapshot *stats_counters(const struct ext2 *ext2) {
+	/*** Counters of calling thread, NULL if they can't be allocated ***/
+	struct ext2_stats *stats = ext2->stats;
+	if (!stats)
+		return NULL;
+	for (int i = 0; i < STATS_THREAD_SLOTS; ++i)
+		if (stats_slots[i].id == stats->id)
+			return &stats_slots[i].thread->counters;
+	pthread_t self = pthread_self();
+	pthread_mutex_lock(&stats->lock);
+	struct stats_thread *thread = stats->threads;
+	while (thread && !pthread_equal(thread->owner, self))
+		thread = thread->next;
+	if (!thread) {
+		thread = calloc(1, sizeof(*thread));
+		if (!thread) {
+			pthread_mutex_unlock(&stats->lock);
+			return NULL;
+		}
+		thread->owner = self;
+		thread->next = stats->threads;
+		stats->threads = thread;
+	}
+	pthread_mutex_unlock(&stats->lock);
+	/*** Evicted image is found on the list again if this thread comes back ***/
+	u32 slot = stats_victim++ % STATS_THREAD_SLOTS;
+	stats_slots[slot].id = stats->id;
+	stats_slots[slot].thread = thread;
+	return &thread->counters;
+}
+
+static void stats_add(u64 *counter, u64 value) {
+	/*** Only owner thread writes, readers load concurrently ***/
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static u32 stats_bucket(u64 ns) {
+	if (ns < STATS_SUB)
+		return ns;
+	int exp = 63 - __builtin_clzll(ns);
+	u32 bucket = (exp - EXT2_STATS_SUB_BITS + 1) * STATS_SUB + ((ns >> (exp - EXT2_STATS_SUB_BITS)) & (STATS_SUB - 1));
+	return bucket < EXT2_STATS_BUCKETS ? bucket : EXT2_STATS_BUCKETS - 1;
+}
+
+static u64 stats_bucket_max(u32 bucket) {
+	/*** Largest value that falls into bucket ***/
+	if (bucket < STATS_SUB)
+		return bucket;
+	int shift = bucket / STATS_SUB - 1;
+	return ((u64)(STATS_SUB + bucket % STATS_SUB + 1) << shift) - 1;
+}
+
+void ext2_stats_record(const struct ext2 *ext2, int op, u64 start, u64 bytes) {
+	struct ext2_stats_snapshot *counters = stats_counters(ext2);
+	if (!counters)
+		return;
+	u64 ns = ext2_stats_now() - start;
+	struct ext2_stats_op *stat = &counters->ops[op];
+	stats_add(&stat->count, 1);
+	stats_add(&stat->bytes, bytes);
+	stats_add(&stat->total_ns, ns);
+	stats_add(&stat->hist[stats_bucket(ns)], 1);
+	if (ns > stat->max_ns)
+		__atomic_store_n(&stat->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+void ext2_stats_syscall(const struct ext2 *ext2) {
+	struct ext2_stats_snapshot *counters = stats_counters(ext2);
+	if (counters)
+		stats_add(&counters->syscalls, 1);
+}
+
+void ext2_stats_read(const struct ext2 *ext2, struct ext2_stats_snapshot *snapshot) {
+	memset(snapshot, 0, sizeof(*snapshot));
+	struct ext2_stats *stats = ext2->stats;
+	if (!stats)
+		return;
+	pthread_mutex_lock(&stats->lock);
+	for (struct stats_thread *thread = stats->threads; thread; thread = thread->next) {
+		const struct ext2_stats_snapshot *counters = &thread->counters;
+		for (int op = 0; op < EXT2_STAT_OPS; ++op) {
+			const struct ext2_stats_op *from = &counters->ops[op];
+			struct ext2_stats_op *to = &snapshot->ops[op];
+			to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+			to->bytes += __atomic_load_n(&from->bytes, __ATOMIC_RELAXED);
+			to->total_ns += __atomic_load_n(&from->total_ns, __ATOMIC_RELAXED);
+			u64 max_ns = __atomic_load_n(&from->max_ns, __ATOMIC_RELAXED);
+			if (max_ns > to->max_ns)
+				to->max_ns = max_ns;
+			for (u32 b = 0; b < EXT2_STATS_BUCKETS; ++b)
+				to->hist[b] += __atomic_load_n(&from->hist[b], __ATOMIC_RELAXED);
+		}
+		snapshot->syscalls += __atomic_load_n(&counters->syscalls, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&stats->lock);
+}
+
+u64 ext2_stats_percentile(const struct ext2_stats_op *op, double p) {
+	/*** Counters are loaded one by one, histogram total may differ from count ***/
+	u64 total = 0;
+	for (u32 b = 0; b < EXT2_STATS_BUCKETS; ++b)
+		total += op->hist[b];
+	if (!total)
+		return 0;
+	u64 rank = p * total;
+	if (rank >= total)
+		rank = total - 1;
+	u64 seen = 0;
+	for (u32 b = 0; b < EXT2_STATS_BUCKETS; ++b) {
+		seen += op->hist[b];
+		if (seen > rank)
+			return stats_bucket_max(b) < op->max_ns ? stats_bucket_max(b) : op->max_ns;
+	}
+	return op->max_ns;
+}
+
+int ext2_stats_dump(const struct ext2 *ext2, FILE *out) {
+	/*** Times in microseconds, histogram as [bucket max ns, calls] of non-empty buckets ***/
+	static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const char *percentile_names[] = { "p50_us", "p90_us", "p99_us", "p999_us" };
+	struct ext2_stats_snapshot *snapshot = malloc(sizeof(*snapshot));
+	if (!snapshot)
+		return -1;
+	ext2_stats_read(ext2, snapshot);
+	fprintf(out, "{\"syscalls\": %llu", (unsigned long long)snapshot->syscalls);
+	for (int op = 0; op < EXT2_STAT_OPS; ++op) {
+		const struct ext2_stats_op *stat = &snapshot->ops[op];
+		fprintf(out, ", \"%s\": {\"count\": %llu, \"bytes\": %llu, \"total_us\": %.3f, \"max_us\": %.3f",
+			stats_names[op], (unsigned long long)stat->count, (unsigned long long)stat->bytes,
+			stat->total_ns / 1e3, stat->max_ns / 1e3);
+		for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i)
+			fprintf(out, ", \"%s\": %.3f", percentile_names[i], ext2_stats_percentile(stat, percentiles[i]) / 1e3);
+		fprintf(out, ", \"hist\": [");
+		int first = 1;
+		for (u32 b = 0; b < EXT2_STATS_BUCKETS; ++b) {
+			if (!stat->hist[b])
+				continue;
+			fprintf(out, "%s[%llu, %llu]", first ? "" : ", ", (unsigned long long)stats_bucket_max(b), (unsigned long long)stat->hist[b]);
+			first = 0;
+		}
+		fprintf(out, "]}");
+	}
+	fprintf(out, "}");
+	free(snapshot);
+	return ferror(out) ? -1 : 0;
+}
+#endif
@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "ext2.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define USAGE_X86
+#endif
+
+/*******************
+ * Capacity statistics straight from block and inode bitmaps.
+ * Set bits are counted with AVX2 (nibble lookup with vpshufb), POPCNT or a
+ * portable SWAR loop, chosen once by CPU features.
+ * Free block runs are searched a 64-bit word at a time, all-free and all-used
+ * words are skipped without looking at bits.
+ ******************/
+
+typedef u64 (*popcount_fn)(const u8 *data, size_t len);
+
+static u64 popcount_scalar(const u8 *data, size_t len) {
+	u64 res = 0;
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		u64 x;
+		memcpy(&x, data + i, sizeof(x));
+		x = x - ((x >> 1) & 0x5555555555555555ULL);
+		x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+		x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		res += (x * 0x0101010101010101ULL) >> 56;
+	}
+	for (; i < len; ++i) {
+		u8 b = data[i];
+		for (; b; b &= b - 1)
+			res++;
+	}
+	return res;
+}
+
+#ifdef USAGE_X86
+__attribute__((target("popcnt")))
+static u64 popcount_popcnt(const u8 *data, size_t len) {
+	u64 res = 0;
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		u64 x;
+		memcpy(&x, data + i, sizeof(x));
+		res += __builtin_popcountll(x);
+	}
+	return res + popcount_scalar(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static u64 popcount_avx2(const u8 *data, size_t len) {
+	const __m256i lookup = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+	__m256i acc = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+		__m256i lo = _mm256_and_si256(v, low_mask);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+		__m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+	}
+	u64 res = (u64)_mm256_extract_epi64(acc, 0) + (u64)_mm256_extract_epi64(acc, 1) +
+		(u64)_mm256_extract_epi64(acc, 2) + (u64)_mm256_extract_epi64(acc, 3);
+	return res + popcount_scalar(data + i, len - i);
+}
+#endif
+
+static popcount_fn popcount_select(const char **name) {
+#ifdef USAGE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		*name = "avx2";
+		return popcount_avx2;
+	}
+	if (__builtin_cpu_supports("popcnt")) {
+		*name = "popcnt";
+		return popcount_popcnt;
+	}
+#endif
+	*name = "scalar";
+	return popcount_scalar;
+}
+
+u64 ext2_popcount(const u8 *data, size_t len) {
+	const char *name;
+	return popcount_select(&name)(data, len);
+}
+
+static u64 bitmap_count(popcount_fn popcount, const u8 *bitmap, u32 nbits) {
+	/*** Bits past nbits are padding ***/
+	u64 res = popcount(bitmap, nbits / 8);
+	if (nbits % 8)
+		res += popcount_scalar(&(u8){ bitmap[nbits / 8] & ((1u << (nbits % 8)) - 1) }, 1);
+	return res;
+}
+
+/*** Free runs ***/
+
+struct run_state {
+	u64 start;		/* First block of current run */
+	u64 len;		/* 0 when not in a run */
+};
+
+static void run_end(struct ext2_usage *usage, struct run_state *run) {
+	if (!run->len)
+		return;
+	int order = 63 - __builtin_clzll(run->len);
+	if (order >= EXT2_FREE_RUN_ORDERS)
+		order = EXT2_FREE_RUN_ORDERS - 1;
+	usage->free_runs[order]++;
+	if (run->len > usage->largest_free_run) {
+		usage->largest_free_run = run->len;
+		usage->largest_free_run_start = run->start;
+	}
+	run->len = 0;
+}
+
+static void run_add(struct run_state *run, u64 block, u64 len) {
+	if (!run->len)
+		run->start = block;
+	run->len += len;
+}
+
+static void bitmap_runs(struct ext2_usage *usage, struct run_state *run, const u8 *bitmap, u32 nbits, u64 first_block) {
+	u32 bit = 0;
+	for (; bit + 64 <= nbits; bit += 64) {
+		u64 word;
+		memcpy(&word, bitmap + bit / 8, sizeof(word));
+		word = le64toh(word);
+		if (!word) { /*** All free ***/
+			run_add(run, first_block + bit, 64);
+			continue;
+		}
+		if (word == ~0ULL) {
+			run_end(usage, run);
+			continue;
+		}
+		for (u32 i = 0; i < 64;) {
+			if (word & (1ULL << i)) {
+				run_end(usage, run);
+				i++;
+				continue;
+			}
+			/*** Length of zero run starting at bit i ***/
+			u64 rest = word >> i;
+			u32 len = rest ? (u32)__builtin_ctzll(rest) : 64 - i;
+			run_add(run, first_block + bit + i, len);
+			i += len;
+		}
+	}
+	for (; bit < nbits; ++bit) {
+		if (bitmap[bit / 8] & (1u << (bit % 8)))
+			run_end(usage, run);
+		else
+			run_add(run, first_block + bit, 1);
+	}
+}
+
+static const u8 *bitmap_get(const struct ext2 *ext2, u32 block_no, u8 *buf) {
+	u64 offset = (u64)block_no * ext2->blocksize;
+	if (ext2->map)
+		return ext2->io->map(ext2, offset, ext2->blocksize);
+	if (ext2_io_read(ext2, buf, ext2->blocksize, offset))
+		return NULL;
+	return buf;
+}
+
+int ext2_usage_stats(const struct ext2 *ext2, struct ext2_usage *usage) {
+	memset(usage, 0, sizeof(*usage));
+	popcount_fn popcount = popcount_select(&usage->kernel);
+	u8 *buf = ext2_pool_alloc(ext2->blocksize);
+	if (!buf)
+		return -1;
+	struct run_state run = { 0, 0 };
+	u64 data_blocks = ext2->blocks_count - ext2->first_data_block;
+	for (u32 group = 0; group < ext2->groups_count; ++group) {
+		u64 group_first = (u64)group * ext2->blocks_per_group;
+		u32 nblocks = data_blocks - group_first < ext2->blocks_per_group ? data_blocks - group_first : ext2->blocks_per_group;
+		const u8 *bitmap = bitmap_get(ext2, ext2->groups.block_bitmap[group], buf);
+		if (!bitmap)
+			goto err_ext2_usage_stats;
+		u64 free_blocks = nblocks - bitmap_count(popcount, bitmap, nblocks);
+		bitmap_runs(usage, &run, bitmap, nblocks, ext2->first_data_block + group_first);
+		bitmap = bitmap_get(ext2, ext2->groups.inode_bitmap[group], buf);
+		if (!bitmap)
+			goto err_ext2_usage_stats;
+		u64 free_inodes = ext2->inodes_per_group - bitmap_count(popcount, bitmap, ext2->inodes_per_group);
+		usage->free_blocks += free_blocks;
+		usage->free_inodes += free_inodes;
+		usage->gd_free_blocks += ext2->groups.free_blocks_count[group];
+		usage->gd_free_inodes += ext2->groups.free_inodes_count[group];
+		if (free_blocks != ext2->groups.free_blocks_count[group] || free_inodes != ext2->groups.free_inodes_count[group])
+			usage->mismatched_groups++;
+	}
+	run_end(usage, &run);
+	usage->blocks_count = ext2->blocks_count;
+	usage->inodes_count = ext2->inodes_count;
+	usage->sb_free_blocks = ext2->free_blocks_count;
+	usage->sb_free_inodes = ext2->free_inodes_count;
+	ext2_pool_free(buf);
+	return 0;
+err_ext2_usage_stats:
+	ext2_pool_free(buf);
+	return -1;
+}
@@ -0,0 +1,358 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ext2.h"
+
+/*******************
+ * Whole tree walk from root with a pool of threads.
+ * Every worker owns a deque of directories to read. Owner pushes and pops at the
+ * bottom (depth first, warm cache), idle workers steal from the top of others,
+ * which hands out the oldest and usually biggest subtrees.
+ * pending counts directories pushed but not read yet, walk ends when it is zero.
+ * Workers that find nothing to steal sleep on idle_cond, pushes wake one of
+ * them, end of walk and stop wake all.
+ * Names only walk trusts file_type of dirents and reads inodes just for entries
+ * without one, so with filetype feature it touches directory blocks only.
+ ******************/
+
+struct walk_item {
+	u32 ino;
+	char *path;
+};
+
+struct walk_deque {
+	pthread_mutex_t lock;
+	struct walk_item *items;	/* Live items are items[top..bottom) */
+	u32 top, bottom, capacity;
+};
+
+struct walk_worker {
+	struct walk *walk;
+	struct walk_deque deque;
+	u32 id;
+	pthread_t thread;
+	u64 entries;
+	u64 dirs;
+	char *path;		/* Buffer for child paths */
+	size_t path_size;
+};
+
+struct walk {
+	const struct ext2 *ext2;
+	ext2_walk_cb_t cb;
+	ext2_walk_names_cb_t names_cb;	/* Used instead of cb by names only walk */
+	void *arg;
+	struct walk_worker *workers;
+	u32 nr_workers;
+	u64 pending;
+	int stop;
+	int err;		/* errno of first failure */
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	u32 idle;		/* Workers asleep or going to sleep on idle_cond */
+};
+
+/*** Deque ***/
+
+static int deque_push(struct walk_deque *deque, struct walk_item item) {
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom == deque->capacity) {
+		if (deque->top) { /*** Reuse space freed by thieves ***/
+			memmove(deque->items, deque->items + deque->top, (deque->bottom - deque->top) * sizeof(item));
+			deque->bottom -= deque->top;
+			deque->top = 0;
+		} else {
+			u32 capacity = deque->capacity ? deque->capacity * 2 : 64;
+			struct walk_item *items = realloc(deque->items, capacity * sizeof(item));
+			if (!items) {
+				pthread_mutex_unlock(&deque->lock);
+				return -1;
+			}
+			deque->items = items;
+			deque->capacity = capacity;
+		}
+	}
+	deque->items[deque->bottom++] = item;
+	pthread_mutex_unlock(&deque->lock);
+	return 0;
+}
+
+static int deque_pop(struct walk_deque *deque, struct walk_item *item) {
+	int res = 0;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->top < deque->bottom) {
+		*item = deque->items[--deque->bottom];
+		res = 1;
+	}
+	if (deque->top == deque->bottom)
+		deque->top = deque->bottom = 0;
+	pthread_mutex_unlock(&deque->lock);
+	return res;
+}
+
+static int deque_steal(struct walk_deque *deque, struct walk_item *item, int wait) {
+	int res = 0;
+	if (!wait && pthread_mutex_trylock(&deque->lock)) /*** Busy victim, try another ***/
+		return 0;
+	if (wait)
+		pthread_mutex_lock(&deque->lock);
+	if (deque->top < deque->bottom) {
+		*item = deque->items[deque->top++];
+		res = 1;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return res;
+}
+
+/*** Workers ***/
+
+static void walk_wake(struct walk *walk, int all) {
+	pthread_mutex_lock(&walk->idle_lock);
+	if (all)
+		pthread_cond_broadcast(&walk->idle_cond);
+	else
+		pthread_cond_signal(&walk->idle_cond);
+	pthread_mutex_unlock(&walk->idle_lock);
+}
+
+static void walk_stop(struct walk *walk) {
+	__atomic_store_n(&walk->stop, 1, __ATOMIC_RELEASE);
+	walk_wake(walk, 1);
+}
+
+static void walk_fail(struct walk *walk, int err) {
+	int expected = 0;
+	__atomic_compare_exchange_n(&walk->err, &expected, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	walk_stop(walk);
+}
+
+static int walk_push(struct walk_worker *worker, u32 ino, const char *path) {
+	struct walk_item item = { ino, strdup(path) };
+	if (!item.path)
+		return -1;
+	__atomic_add_fetch(&worker->walk->pending, 1, __ATOMIC_RELAXED);
+	if (deque_push(&worker->deque, item)) {
+		__atomic_sub_fetch(&worker->walk->pending, 1, __ATOMIC_RELAXED);
+		free(item.path);
+		return -1;
+	}
+	/*** Sleeper counts itself before it looks at deques, so it sees item or gets woken ***/
+	if (__atomic_load_n(&worker->walk->idle, __ATOMIC_SEQ_CST))
+		walk_wake(worker->walk, 0);
+	return 0;
+}
+
+static int walk_child_path(struct walk_worker *worker, const char *parent, const struct ext2_dirent *dirent) {
+	size_t parent_len = strlen(parent);
+	if (parent_len == 1) /*** Root is "/" ***/
+		parent_len = 0;
+	size_t size = parent_len + 1 + dirent->name_len + 1;
+	if (size > worker->path_size) {
+		char *path = realloc(worker->path, size);
+		if (!path)
+			return -1;
+		worker->path = path;
+		worker->path_size = size;
+	}
+	memcpy(worker->path, parent, parent_len);
+	worker->path[parent_len] = '/';
+	memcpy(worker->path + parent_len + 1, dirent->name, dirent->name_len);
+	worker->path[size - 1] = '\0';
+	return 0;
+}
+
+static int walk_dir(struct walk_worker *worker, const struct walk_item *dir) {
+	struct walk *walk = worker->walk;
+	struct ext2_dir_iter iter;
+	struct ext2_dirent dirent;
+	struct ext2_inode inode;
+	int res = ext2_dir_iter_new(&iter, walk->ext2, dir->ino);
+	if (res)
+		goto out_walk_dir;
+	worker->dirs++;
+	while ((res = ext2_dir_iter_next(&iter, &dirent)) > 0) {
+		if (dirent.name[0] == '.' && (dirent.name_len == 1 || (dirent.name_len == 2 && dirent.name[1] == '.')))
+			continue;
+		/*** Such a name would be read as a different path by callbacks ***/
+		if (!dirent.name_len || memchr(dirent.name, '/', dirent.name_len) || memchr(dirent.name, '\0', dirent.name_len)) {
+			errno = ERR_FS_CORRUPT;
+			res = -1;
+			break;
+		}
+		if (walk_child_path(worker, dir->path, &dirent)) {
+			res = -1;
+			break;
+		}
+		u8 file_type = dirent.file_type;
+		if (walk->cb || file_type == EXT2_FT_UNKNOWN) {
+			if (read_inode(walk->ext2, &inode, dirent.inode)) {
+				res = -1;
+				break;
+			}
+			file_type = ext2_mode_to_file_type(inode.i_mode);
+		}
+		worker->entries++;
+		if (walk->cb ? walk->cb(walk->arg, worker->path, dirent.inode, &inode) :
+				walk->names_cb(walk->arg, worker->path, dirent.inode, file_type)) {
+			walk_stop(walk);
+			break;
+		}
+		if (file_type == EXT2_FT_DIR && walk_push(worker, dirent.inode, worker->path)) {
+			res = -1;
+			break;
+		}
+		if (__atomic_load_n(&walk->stop, __ATOMIC_ACQUIRE))
+			break;
+	}
+out_walk_dir:
+	ext2_dir_iter_end(&iter);
+	return res < 0 ? -1 : 0;
+}
+
+static int walk_get(struct walk_worker *worker, struct walk_item *item, int wait) {
+	/*** With wait busy deques are waited for, not skipped ***/
+	struct walk *walk = worker->walk;
+	if (deque_pop(&worker->deque, item))
+		return 1;
+	for (u32 i = 1; i < walk->nr_workers; ++i)
+		if (deque_steal(&walk->workers[(worker->id + i) % walk->nr_workers].deque, item, wait))
+			return 1;
+	return 0;
+}
+
+static int walk_get_or_sleep(struct walk_worker *worker, struct walk_item *item) {
+	/*** Returns 1 with item, 0 when walk is over or stopped ***/
+	struct walk *walk = worker->walk;
+	if (walk_get(worker, item, 0))
+		return 1;
+	int res = 0;
+	pthread_mutex_lock(&walk->idle_lock);
+	__atomic_add_fetch(&walk->idle, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&walk->stop, __ATOMIC_ACQUIRE)) {
+		if (walk_get(worker, item, 1)) {
+			res = 1;
+			break;
+		}
+		if (!__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE))
+			break;
+		pthread_cond_wait(&walk->idle_cond, &walk->idle_lock);
+	}
+	__atomic_sub_fetch(&walk->idle, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&walk->idle_lock);
+	return res;
+}
+
+static void *walk_worker(void *arg) {
+	struct walk_worker *worker = arg;
+	struct walk *walk = worker->walk;
+	struct walk_item item;
+	while (!__atomic_load_n(&walk->stop, __ATOMIC_ACQUIRE)) {
+		if (!walk_get_or_sleep(worker, &item))
+			break;
+		if (walk_dir(worker, &item))
+			walk_fail(walk, errno);
+		free(item.path);
+		/*** Children are already counted, so zero means nothing is left ***/
+		if (!__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL))
+			walk_wake(walk, 1);
+	}
+	return NULL;
+}
+
+static double walk_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int ext2_walk(const struct ext2 *ext2, u32 nr_threads, ext2_walk_cb_t cb, void *arg, struct ext2_walk_stats *stats) {
+	return ext2_walk_from(ext2, EXT2_ROOT_INO, nr_threads, cb, arg, stats);
+}
+
+static int walk_run(struct walk *walk, u32 ino, struct ext2_walk_stats *stats) {
+	/*** Returns 0, or -1 and sets errno ***/
+	const struct ext2 *ext2 = walk->ext2;
+	u32 nr_threads = walk->nr_workers;
+	int res;
+	double start = walk_now();
+	if (!nr_threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = cpus > 0 ? cpus : 1;
+	}
+	struct ext2_inode root;
+	res = read_inode(ext2, &root, ino);
+	if (res)
+		return res;
+	if (!ISDIR(root.i_mode)) {
+		errno = ERR_FS_NOT_DIR;
+		return -1;
+	}
+	walk->nr_workers = nr_threads;
+	if (walk->cb ? walk->cb(walk->arg, "/", ino, &root) : walk->names_cb(walk->arg, "/", ino, EXT2_FT_DIR))
+		return 0;
+	walk->workers = calloc(nr_threads, sizeof(*walk->workers));
+	if (!walk->workers)
+		return -1;
+	pthread_mutex_init(&walk->idle_lock, NULL);
+	pthread_cond_init(&walk->idle_cond, NULL);
+	for (u32 i = 0; i < nr_threads; ++i) {
+		walk->workers[i].walk = walk;
+		walk->workers[i].id = i;
+		pthread_mutex_init(&walk->workers[i].deque.lock, NULL);
+	}
+	res = walk_push(&walk->workers[0], ino, "/");
+	u32 started = 0;
+	for (; !res && started < nr_threads; ++started) {
+		if (pthread_create(&walk->workers[started].thread, NULL, walk_worker, &walk->workers[started])) {
+			walk_fail(walk, EAGAIN);
+			break;
+		}
+	}
+	struct ext2_walk_stats total = { 0, 0, 0, 0 };
+	/*** Every worker may still steal from any deque until all are joined ***/
+	for (u32 i = 0; i < started; ++i)
+		pthread_join(walk->workers[i].thread, NULL);
+	for (u32 i = 0; i < nr_threads; ++i) {
+		struct walk_worker *worker = &walk->workers[i];
+		total.entries += worker->entries;
+		total.dirs += worker->dirs;
+		/*** Left over items when walk was stopped ***/
+		struct walk_item item;
+		while (deque_pop(&worker->deque, &item))
+			free(item.path);
+		free(worker->deque.items);
+		free(worker->path);
+		pthread_mutex_destroy(&worker->deque.lock);
+	}
+	free(walk->workers);
+	pthread_cond_destroy(&walk->idle_cond);
+	pthread_mutex_destroy(&walk->idle_lock);
+	total.entries++; /*** Root ***/
+	total.seconds = walk_now() - start;
+	total.entries_per_sec = total.seconds > 0 ? total.entries / total.seconds : 0;
+	if (stats)
+		*stats = total;
+	if (res)
+		return res;
+	if (walk->err) {
+		errno = walk->err;
+		return -1;
+	}
+	return 0;
+}
+
+int ext2_walk_from(const struct ext2 *ext2, u32 ino, u32 nr_threads, ext2_walk_cb_t cb, void *arg, struct ext2_walk_stats *stats) {
+	/*** Returns 0, or -1 and sets errno ***/
+	struct walk walk = { .ext2 = ext2, .cb = cb, .arg = arg, .nr_workers = nr_threads };
+	return walk_run(&walk, ino, stats);
+}
+
+int ext2_walk_names(const struct ext2 *ext2, u32 ino, u32 nr_threads, ext2_walk_names_cb_t cb, void *arg, struct ext2_walk_stats *stats) {
+	/*** Returns 0, or -1 and sets errno ***/
+	struct walk walk = { .ext2 = ext2, .names_cb = cb, .arg = arg, .nr_workers = nr_threads };
+	return walk_run(&walk, ino, stats);
+}
@@ -0,0 +1,850 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "ext2.h"
+
+/*******************
+ * Benchmarks of libext2 on generated images.
+ * Build: gcc -O2 -pthread -o ext2bench ext2bench.c ext2.c ext2_*.c
+ * Usage: ext2bench mkimage [-b block_size] [-i inodes] [-f fanout] [-D depth]
+ *                          [-n files_per_dir] [-s min:max] [-x indirect_depth] [-S seed] image
+ *        ext2bench run [-n ops] [-j threads] [-c] [-S seed] image
+ *
+ * mkimage writes an ext2 image (revision 1, no optional features) with a tree
+ * of depth levels, fanout subdirectories and files_per_dir files in every
+ * directory. File sizes are log-uniform in [min, max], "/big" is made large
+ * enough to use indirect_depth levels of indirect blocks. Same options and seed
+ * always give the same image.
+ * run opens the image again for every scenario (lookup, list, walk, seqread,
+ * randread) and prints results as JSON: ops/s, MB/s, p50/p99 latency of one
+ * operation and read/write syscalls from /proc/self/io. -c drops image pages
+ * from page cache before each scenario. Built with -DEXT2_STATS every scenario
+ * also carries the library's own counters and histograms under "libext2".
+ ******************/
+
+#define GEN_TIME		1700000000 /* All timestamps, keeps output stable */
+#define GEN_MAX_NODES		(16 << 20)
+#define NONE			0xffffffffu
+
+/*** Deterministic random numbers (splitmix64) ***/
+
+static u64 rng_next(u64 *state) {
+	u64 z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*** Image generator ***/
+
+struct gen_opts {
+	u32 block_size;
+	u32 inodes;		/* At least this many inodes, 0 for just enough */
+	u32 fanout;		/* Subdirectories of every directory above depth */
+	u32 depth;		/* Levels of directories below root */
+	u32 files;		/* Files in every directory */
+	u32 min_size, max_size;
+	u32 indirect;		/* Indirect levels used by /big, 0 for no /big */
+	u64 seed;
+};
+
+struct gen_node {
+	char name[16];
+	u32 parent;		/* Index in gen->nodes */
+	u32 first_child, next_sibling;
+	u16 mode;
+	u16 links;
+	u64 size;
+	u32 nblocks;		/* Data blocks */
+};
+
+struct gen {
+	struct gen_opts opts;
+	int fd;
+	struct gen_node *nodes;	/* Node i is inode first_ino + i - 1, node 0 is root */
+	u32 count, capacity;
+	u32 bs, per_block;
+	u32 first_data_block, blocks_per_group, inodes_per_group, groups;
+	u32 gdt_blocks, itable_blocks, overhead;
+	u32 blocks_count, inodes_count;
+	u32 next_block;		/* Allocation cursor */
+	u8 *block_bitmaps, *inode_bitmaps;
+	u8 *itables;
+	u32 *group_dirs;
+	u8 *buf;
+	u64 rng;
+};
+
+static u32 gen_ino(u32 node) {
+	/*** Root is inode 2, other nodes follow reserved inodes ***/
+	return node ? EXT2_GOOD_OLD_FIRST_INO + node - 1 : EXT2_ROOT_INO;
+}
+
+static u64 gen_indirect_blocks(u64 n, u32 per) {
+	/*** Indirect blocks needed to map n data blocks ***/
+	u64 res = 0;
+	n = n > EXT2_NDIR_BLOCKS ? n - EXT2_NDIR_BLOCKS : 0;
+	u64 span = per;
+	for (int depth = 1; depth <= 3 && n; ++depth) {
+		u64 part = n < span ? n : span;
+		/*** Top block plus every level below it ***/
+		u64 level = per;
+		res++;
+		for (int i = 1; i < depth; ++i) {
+			res += (part + level - 1) / level;
+			level *= per;
+		}
+		n -= part;
+		span *= per;
+	}
+	return res;
+}
+
+static u32 gen_add(struct gen *gen, u32 parent, const char *name, u16 mode, u64 size) {
+	if (gen->count == gen->capacity) {
+		u32 capacity = gen->capacity ? gen->capacity * 2 : 1024;
+		struct gen_node *nodes = capacity > GEN_MAX_NODES ? NULL : realloc(gen->nodes, capacity * sizeof(*nodes));
+		if (!nodes)
+			return NONE;
+		gen->nodes = nodes;
+		gen->capacity = capacity;
+	}
+	u32 i = gen->count++;
+	struct gen_node *node = &gen->nodes[i];
+	memset(node, 0, sizeof(*node));
+	snprintf(node->name, sizeof(node->name), "%s", name);
+	node->parent = parent;
+	node->first_child = node->next_sibling = NONE;
+	node->mode = mode;
+	node->links = ISDIR(mode) ? 2 : 1;
+	node->size = size;
+	node->nblocks = (size + gen->bs - 1) / gen->bs;
+	if (parent != NONE) {
+		/*** Children are kept in creation order ***/
+		struct gen_node *p = &gen->nodes[parent];
+		u32 *link = &p->first_child;
+		while (*link != NONE)
+			link = &gen->nodes[*link].next_sibling;
+		*link = i;
+		if (ISDIR(mode))
+			p->links++;
+	}
+	return i;
+}
+
+static u64 gen_file_size(struct gen *gen) {
+	/*** Log-uniform: random power of two range, then uniform inside it ***/
+	u32 lo = 0, hi = 0;
+	while (lo < 63 && (1ULL << lo) <= gen->opts.min_size)
+		lo++;
+	while (hi < 63 && (1ULL << hi) <= gen->opts.max_size)
+		hi++;
+	u32 bits = lo + rng_next(&gen->rng) % (hi - lo + 1);
+	u64 from = bits ? 1ULL << (bits - 1) : 0;
+	u64 size = from + rng_next(&gen->rng) % ((1ULL << bits) - from);
+	if (size < gen->opts.min_size)
+		size = gen->opts.min_size;
+	if (size > gen->opts.max_size)
+		size = gen->opts.max_size;
+	return size;
+}
+
+static int gen_tree(struct gen *gen, u32 dir, u32 level) {
+	char name[16];
+	for (u32 i = 0; i < gen->opts.files; ++i) {
+		snprintf(name, sizeof(name), "f%u", i);
+		if (gen_add(gen, dir, name, EXT2_S_IFREG | 0644, gen_file_size(gen)) == NONE)
+			return -1;
+	}
+	if (level == gen->opts.depth)
+		return 0;
+	for (u32 i = 0; i < gen->opts.fanout; ++i) {
+		snprintf(name, sizeof(name), "d%u", i);
+		u32 sub = gen_add(gen, dir, name, EXT2_S_ISDIR | 0755, 0);
+		if (sub == NONE || gen_tree(gen, sub, level + 1))
+			return -1;
+	}
+	return 0;
+}
+
+static u32 gen_dir_layout(struct gen *gen, u32 dir, u8 *buf) {
+	/*** Packs entries into blocks, returns number of blocks, fills buf if given ***/
+	u32 blocks = 1, offset = 0, last = 0;
+	u32 child = gen->nodes[dir].first_child;
+	for (int i = 0; ; ++i) {
+		const char *name;
+		u32 ino;
+		if (i == 0) {
+			name = ".";
+			ino = gen_ino(dir);
+		} else if (i == 1) {
+			name = "..";
+			ino = gen_ino(gen->nodes[dir].parent == NONE ? dir : gen->nodes[dir].parent);
+		} else if (child != NONE) {
+			name = gen->nodes[child].name;
+			ino = gen_ino(child);
+			child = gen->nodes[child].next_sibling;
+		} else {
+			break;
+		}
+		u32 len = strlen(name);
+		u32 rec_len = (sizeof(struct ext2_dir_entry) + len + 3) & ~3u;
+		if (offset + rec_len > gen->bs) { /*** Last entry of block takes the rest ***/
+			if (buf)
+				*(__le16 *)(buf + (u64)(blocks - 1) * gen->bs + last + 4) = htole16(gen->bs - last);
+			blocks++;
+			offset = 0;
+		}
+		if (buf) {
+			u8 *p = buf + (u64)(blocks - 1) * gen->bs + offset;
+			struct ext2_dir_entry entry = { htole32(ino), htole16(rec_len), htole16(len) };
+			memcpy(p, &entry, sizeof(entry));
+			memcpy(p + sizeof(entry), name, len);
+		}
+		last = offset;
+		offset += rec_len;
+	}
+	if (buf)
+		*(__le16 *)(buf + (u64)(blocks - 1) * gen->bs + last + 4) = htole16(gen->bs - last);
+	return blocks;
+}
+
+static int gen_geometry(struct gen *gen) {
+	/*** Smallest number of full groups that holds all blocks and inodes ***/
+	u64 blocks = 0;
+	for (u32 i = 0; i < gen->count; ++i) {
+		struct gen_node *node = &gen->nodes[i];
+		if (ISDIR(node->mode)) {
+			node->nblocks = gen_dir_layout(gen, i, NULL);
+			node->size = (u64)node->nblocks * gen->bs;
+		}
+		blocks += node->nblocks + gen_indirect_blocks(node->nblocks, gen->per_block);
+	}
+	blocks += blocks / 50 + 64;
+	u64 inodes = EXT2_GOOD_OLD_FIRST_INO - 1 + gen->count;
+	if (inodes < gen->opts.inodes)
+		inodes = gen->opts.inodes;
+	u32 inodes_per_block = gen->bs / EXT2_GOOD_OLD_INODE_SIZE;
+	for (u32 groups = 1; groups < 1u << 20; ++groups) {
+		u64 ipg = (inodes + groups - 1) / groups;
+		ipg = (ipg + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+		if (ipg > 8 * gen->bs)
+			continue;
+		u32 gdt_blocks = ((u64)groups * sizeof(struct ext2_group_desc) + gen->bs - 1) / gen->bs;
+		u32 itable_blocks = ipg / inodes_per_block;
+		u32 overhead = 1 + gdt_blocks + 2 + itable_blocks;
+		if (overhead >= gen->blocks_per_group || (u64)groups * (gen->blocks_per_group - overhead) < blocks)
+			continue;
+		if ((u64)gen->first_data_block + (u64)groups * gen->blocks_per_group > 0xffffffffULL)
+			break;
+		gen->groups = groups;
+		gen->inodes_per_group = ipg;
+		gen->gdt_blocks = gdt_blocks;
+		gen->itable_blocks = itable_blocks;
+		gen->overhead = overhead;
+		gen->blocks_count = gen->first_data_block + groups * gen->blocks_per_group;
+		gen->inodes_count = groups * ipg;
+		return 0;
+	}
+	errno = EFBIG;
+	return -1;
+}
+
+static u32 gen_group_start(const struct gen *gen, u32 group) {
+	return gen->first_data_block + group * gen->blocks_per_group;
+}
+
+static int gen_alloc(struct gen *gen, u32 *block_no) {
+	u32 group = (gen->next_block - gen->first_data_block) / gen->blocks_per_group;
+	if (gen->next_block < gen_group_start(gen, group) + gen->overhead)
+		gen->next_block = gen_group_start(gen, group) + gen->overhead;
+	if (gen->next_block >= gen->blocks_count) {
+		errno = ENOSPC;
+		return -1;
+	}
+	u32 bit = gen->next_block - gen_group_start(gen, group);
+	gen->block_bitmaps[(u64)group * gen->bs + bit / 8] |= 1 << (bit % 8);
+	*block_no = gen->next_block++;
+	return 0;
+}
+
+static int gen_pwrite(struct gen *gen, const void *buf, size_t len, u64 offset) {
+	if (pwrite(gen->fd, buf, len, offset) != (ssize_t)len) {
+		if (!errno)
+			errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static void gen_fill(struct gen *gen, u32 node, u32 logical, const u8 *dir_data, u8 *buf) {
+	if (dir_data) {
+		memcpy(buf, dir_data + (u64)logical * gen->bs, gen->bs);
+		return;
+	}
+	u64 state = gen->opts.seed ^ ((u64)gen_ino(node) << 32) ^ logical;
+	for (u32 i = 0; i < gen->bs; i += 8) {
+		u64 v = rng_next(&state);
+		memcpy(buf + i, &v, 8);
+	}
+}
+
+static int gen_data(struct gen *gen, u32 node, u32 *logical, const u8 *dir_data, u32 *block_no) {
+	if (gen_alloc(gen, block_no))
+		return -1;
+	gen_fill(gen, node, (*logical)++, dir_data, gen->buf);
+	return gen_pwrite(gen, gen->buf, gen->bs, (u64)*block_no * gen->bs);
+}
+
+static int gen_indirect(struct gen *gen, u32 node, int depth, u32 *logical, const u8 *dir_data, u32 *block_no) {
+	/*** Indirect block goes first, blocks it maps follow it on disk ***/
+	u32 nblocks = gen->nodes[node].nblocks;
+	if (gen_alloc(gen, block_no))
+		return -1;
+	__le32 *map = calloc(gen->per_block, sizeof(*map));
+	if (!map)
+		return -1;
+	int res = 0;
+	for (u32 i = 0; i < gen->per_block && *logical < nblocks && !res; ++i) {
+		u32 child;
+		res = depth == 1 ? gen_data(gen, node, logical, dir_data, &child) : gen_indirect(gen, node, depth - 1, logical, dir_data, &child);
+		map[i] = htole32(child);
+	}
+	if (!res)
+		res = gen_pwrite(gen, map, gen->bs, (u64)*block_no * gen->bs);
+	free(map);
+	return res;
+}
+
+static int gen_inode(struct gen *gen, u32 node) {
+	struct gen_node *n = &gen->nodes[node];
+	struct ext2_inode inode;
+	memset(&inode, 0, sizeof(inode));
+	u8 *dir_data = NULL;
+	if (ISDIR(n->mode)) {
+		dir_data = calloc(n->nblocks, gen->bs);
+		if (!dir_data)
+			return -1;
+		gen_dir_layout(gen, node, dir_data);
+	}
+	u32 logical = 0;
+	u32 block_no;
+	int res = 0;
+	for (int i = 0; i < EXT2_NDIR_BLOCKS && logical < n->nblocks && !res; ++i) {
+		res = gen_data(gen, node, &logical, dir_data, &block_no);
+		inode.i_block[i] = htole32(block_no);
+	}
+	for (int depth = 1; depth <= 3 && logical < n->nblocks && !res; ++depth) {
+		res = gen_indirect(gen, node, depth, &logical, dir_data, &block_no);
+		inode.i_block[EXT2_IND_BLOCK + depth - 1] = htole32(block_no);
+	}
+	free(dir_data);
+	if (res)
+		return -1;
+	u64 blocks = n->nblocks + gen_indirect_blocks(n->nblocks, gen->per_block);
+	inode.i_mode = htole16(n->mode);
+	inode.i_size = htole32(n->size);
+	inode.i_atime = inode.i_ctime = inode.i_mtime = htole32(GEN_TIME);
+	inode.i_links_count = htole16(n->links);
+	inode.i_blocks = htole32(blocks * (gen->bs / 512));
+	u32 ino = gen_ino(node);
+	u32 group = (ino - 1) / gen->inodes_per_group;
+	u32 index = (ino - 1) % gen->inodes_per_group;
+	memcpy(gen->itables + (u64)(ino - 1) * EXT2_GOOD_OLD_INODE_SIZE, &inode, sizeof(inode));
+	gen->inode_bitmaps[(u64)group * gen->bs + index / 8] |= 1 << (index % 8);
+	if (ISDIR(n->mode))
+		gen->group_dirs[group]++;
+	return 0;
+}
+
+static u32 gen_count_bits(const u8 *bitmap, u32 bits) {
+	u32 res = 0;
+	for (u32 i = 0; i < bits; ++i)
+		res += (bitmap[i / 8] >> (i % 8)) & 1;
+	return res;
+}
+
+static int gen_metadata(struct gen *gen) {
+	/*** Superblock and descriptor table copy in every group, then bitmaps and tables ***/
+	u32 bs = gen->bs;
+	struct ext2_group_desc *gdt = calloc(gen->gdt_blocks, bs);
+	struct ext2_super_block sb;
+	if (!gdt)
+		return -1;
+	u64 free_blocks = 0, free_inodes = 0;
+	for (u32 ino = 1; ino < EXT2_GOOD_OLD_FIRST_INO; ++ino) { /*** Reserved inodes, may span groups ***/
+		u32 index = (ino - 1) % gen->inodes_per_group;
+		gen->inode_bitmaps[(u64)((ino - 1) / gen->inodes_per_group) * bs + index / 8] |= 1 << (index % 8);
+	}
+	for (u32 g = 0; g < gen->groups; ++g) {
+		u32 start = gen_group_start(gen, g);
+		u8 *block_bitmap = gen->block_bitmaps + (u64)g * bs;
+		u8 *inode_bitmap = gen->inode_bitmaps + (u64)g * bs;
+		for (u32 i = 0; i < gen->overhead; ++i)
+			block_bitmap[i / 8] |= 1 << (i % 8);
+		for (u32 i = gen->inodes_per_group; i < 8 * bs; ++i) /*** Padding is marked used ***/
+			inode_bitmap[i / 8] |= 1 << (i % 8);
+		u32 group_free_blocks = gen->blocks_per_group - gen_count_bits(block_bitmap, gen->blocks_per_group);
+		u32 group_free_inodes = gen->inodes_per_group - gen_count_bits(inode_bitmap, gen->inodes_per_group);
+		gdt[g].bg_block_bitmap = htole32(start + 1 + gen->gdt_blocks);
+		gdt[g].bg_inode_bitmap = htole32(start + 2 + gen->gdt_blocks);
+		gdt[g].bg_inode_table = htole32(start + 3 + gen->gdt_blocks);
+		gdt[g].bg_free_blocks_count = htole16(group_free_blocks);
+		gdt[g].bg_free_inodes_count = htole16(group_free_inodes);
+		gdt[g].bg_used_dirs_count = htole16(gen->group_dirs[g]);
+		free_blocks += group_free_blocks;
+		free_inodes += group_free_inodes;
+	}
+	memset(&sb, 0, sizeof(sb));
+	sb.s_inodes_count = htole32(gen->inodes_count);
+	sb.s_blocks_count = htole32(gen->blocks_count);
+	sb.s_free_blocks_count = htole32(free_blocks);
+	sb.s_free_inodes_count = htole32(free_inodes);
+	sb.s_first_data_block = htole32(gen->first_data_block);
+	u32 log = 0;
+	while ((1024u << log) < bs)
+		log++;
+	sb.s_log_block_size = sb.s_log_frag_size = htole32(log);
+	sb.s_blocks_per_group = sb.s_frags_per_group = htole32(gen->blocks_per_group);
+	sb.s_inodes_per_group = htole32(gen->inodes_per_group);
+	sb.s_wtime = sb.s_lastcheck = sb.s_mkfs_time = htole32(GEN_TIME);
+	sb.s_max_mnt_count = htole16(0xffff);
+	sb.s_magic = htole16(0xEF53);
+	sb.s_state = htole16(1);
+	sb.s_errors = htole16(1);
+	sb.s_rev_level = htole32(1);
+	sb.s_first_ino = htole32(EXT2_GOOD_OLD_FIRST_INO);
+	sb.s_inode_size = htole16(EXT2_GOOD_OLD_INODE_SIZE);
+	u64 uuid_state = gen->opts.seed;
+	for (int i = 0; i < 16; i += 8) {
+		u64 v = rng_next(&uuid_state);
+		memcpy(sb.s_uuid + i, &v, 8);
+	}
+	memcpy(sb.s_volume_name, "ext2bench", 9);
+	int res = 0;
+	for (u32 g = 0; g < gen->groups && !res; ++g) {
+		u32 start = gen_group_start(gen, g);
+		sb.s_block_group_nr = htole16(g);
+		/*** Primary superblock is at byte 1024 whatever the block size ***/
+		u64 sb_offset = g ? (u64)start * bs : BOOT_LOADER_SPACE;
+		res = gen_pwrite(gen, &sb, sizeof(sb), sb_offset) ||
+			gen_pwrite(gen, gdt, (size_t)gen->gdt_blocks * bs, (u64)(start + 1) * bs) ||
+			gen_pwrite(gen, gen->block_bitmaps + (u64)g * bs, bs, (u64)(start + 1 + gen->gdt_blocks) * bs) ||
+			gen_pwrite(gen, gen->inode_bitmaps + (u64)g * bs, bs, (u64)(start + 2 + gen->gdt_blocks) * bs) ||
+			gen_pwrite(gen, gen->itables + (u64)g * gen->inodes_per_group * EXT2_GOOD_OLD_INODE_SIZE,
+				(size_t)gen->itable_blocks * bs, (u64)(start + 3 + gen->gdt_blocks) * bs) ? -1 : 0;
+	}
+	free(gdt);
+	return res;
+}
+
+static int gen_image(const char *path, const struct gen_opts *opts) {
+	/*** Returns 0, or -1 and sets errno ***/
+	int res = -1;
+	struct gen gen;
+	memset(&gen, 0, sizeof(gen));
+	gen.opts = *opts;
+	gen.rng = opts->seed;
+	gen.bs = opts->block_size;
+	gen.per_block = gen.bs / sizeof(u32);
+	gen.first_data_block = gen.bs == 1024 ? 1 : 0;
+	gen.blocks_per_group = 8 * gen.bs;
+	gen.fd = -1;
+	if (gen.bs < 1024 || gen.bs > 4096 || (gen.bs & (gen.bs - 1)) || opts->min_size > opts->max_size || opts->indirect > 3) {
+		errno = EINVAL;
+		return -1;
+	}
+	u32 root = gen_add(&gen, NONE, "", EXT2_S_ISDIR | 0755, 0);
+	if (root == NONE || gen_add(&gen, root, "lost+found", EXT2_S_ISDIR | 0700, 0) == NONE)
+		goto out_gen_image;
+	if (opts->indirect) {
+		/*** Just past the blocks reachable with one level less ***/
+		u64 blocks = EXT2_NDIR_BLOCKS + 16, span = 1;
+		for (u32 i = 1; i < opts->indirect; ++i)
+			blocks += (span *= gen.per_block);
+		if (blocks * gen.bs > 0xffffffffULL) {
+			errno = EFBIG;
+			goto out_gen_image;
+		}
+		if (gen_add(&gen, root, "big", EXT2_S_IFREG | 0644, blocks * gen.bs) == NONE)
+			goto out_gen_image;
+	}
+	if (gen_tree(&gen, root, 0) || gen_geometry(&gen))
+		goto out_gen_image;
+	gen.block_bitmaps = calloc(gen.groups, gen.bs);
+	gen.inode_bitmaps = calloc(gen.groups, gen.bs);
+	gen.itables = calloc(gen.groups, (size_t)gen.itable_blocks * gen.bs);
+	gen.group_dirs = calloc(gen.groups, sizeof(u32));
+	gen.buf = malloc(gen.bs);
+	if (!gen.block_bitmaps || !gen.inode_bitmaps || !gen.itables || !gen.group_dirs || !gen.buf)
+		goto out_gen_image;
+	gen.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (gen.fd < 0 || ftruncate(gen.fd, (off_t)gen.blocks_count * gen.bs))
+		goto out_gen_image;
+	gen.next_block = gen.first_data_block;
+	for (u32 i = 0; i < gen.count; ++i)
+		if (gen_inode(&gen, i))
+			goto out_gen_image;
+	if (gen_metadata(&gen) || fsync(gen.fd))
+		goto out_gen_image;
+	fprintf(stderr, "%s: %u blocks of %u, %u groups, %u inodes used of %u\n", path, gen.blocks_count, gen.bs, gen.groups,
+		gen.count + EXT2_GOOD_OLD_FIRST_INO - 2, gen.inodes_count);
+	res = 0;
+out_gen_image:
+	if (gen.fd >= 0)
+		close(gen.fd);
+	free(gen.nodes);
+	free(gen.block_bitmaps);
+	free(gen.inode_bitmaps);
+	free(gen.itables);
+	free(gen.group_dirs);
+	free(gen.buf);
+	return res;
+}
+
+/*** Benchmarks ***/
+
+struct bench_entry {
+	char *path;
+	u32 ino;
+	u16 mode;
+	u64 size;
+};
+
+struct bench {
+	const char *image;
+	u32 nr_threads;
+	u64 ops;		/* Operations of lookup and randread */
+	int cold;
+	u64 rng;
+	struct bench_entry *entries;
+	u32 count, capacity;
+	pthread_mutex_t lock;
+	int first;		/* No comma before first JSON object */
+};
+
+struct bench_result {
+	const char *name;
+	u64 ops;
+	u64 bytes;
+	double seconds;
+	u64 *latency;		/* ns of each op, NULL when ops are not timed one by one */
+	u64 syscalls;
+};
+
+static u64 bench_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u64 bench_syscalls(void) {
+	/*** Read and write syscalls of this process, 0 if kernel doesn't tell ***/
+	FILE *f = fopen("/proc/self/io", "r");
+	if (!f)
+		return 0;
+	char key[32];
+	unsigned long long value, res = 0;
+	while (fscanf(f, "%31s %llu", key, &value) == 2)
+		if (!strcmp(key, "syscr:") || !strcmp(key, "syscw:"))
+			res += value;
+	fclose(f);
+	return res;
+}
+
+static int bench_collect(void *arg, const char *path, u32 ino, const struct ext2_inode *inode) {
+	struct bench *bench = arg;
+	int res = 0;
+	pthread_mutex_lock(&bench->lock);
+	if (bench->count == bench->capacity) {
+		u32 capacity = bench->capacity ? bench->capacity * 2 : 1024;
+		struct bench_entry *entries = realloc(bench->entries, capacity * sizeof(*entries));
+		if (!entries) {
+			res = 1;
+			goto out_bench_collect;
+		}
+		bench->entries = entries;
+		bench->capacity = capacity;
+	}
+	struct bench_entry *entry = &bench->entries[bench->count];
+	entry->path = strdup(path);
+	if (!entry->path) {
+		res = 1;
+		goto out_bench_collect;
+	}
+	entry->ino = ino;
+	entry->mode = inode->i_mode;
+	entry->size = ext2_inode_size(inode);
+	bench->count++;
+out_bench_collect:
+	pthread_mutex_unlock(&bench->lock);
+	return res;
+}
+
+static int bench_open(struct bench *bench, struct ext2 *ext2) {
+	if (ext2_open(ext2, bench->image))
+		return -1;
+	if (bench->cold)
+		posix_fadvise(ext2->fd, 0, 0, POSIX_FADV_DONTNEED);
+	return 0;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_report(struct bench *bench, const struct ext2 *ext2, struct bench_result *result) {
+	/*** Latency is null for scenarios that time only the whole run ***/
+	char p50[32] = "null", p99[32] = "null";
+	if (result->latency && result->ops) {
+		qsort(result->latency, result->ops, sizeof(u64), u64_cmp);
+		snprintf(p50, sizeof(p50), "%.3f", result->latency[(result->ops - 1) * 50 / 100] / 1e3);
+		snprintf(p99, sizeof(p99), "%.3f", result->latency[(result->ops - 1) * 99 / 100] / 1e3);
+	}
+	double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+	printf("%s\n    {\"name\": \"%s\", \"ops\": %llu, \"bytes\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+		"\"p50_us\": %s, \"p99_us\": %s, \"syscalls\": %llu",
+		bench->first ? "" : ",", result->name, (unsigned long long)result->ops, (unsigned long long)result->bytes, result->seconds,
+		result->ops / seconds, result->bytes / seconds / (1 << 20), p50, p99, (unsigned long long)result->syscalls);
+#ifdef EXT2_STATS
+	printf(", \"libext2\": ");
+	ext2_stats_dump(ext2, stdout);
+#else
+	(void)ext2;
+#endif
+	printf("}");
+	bench->first = 0;
+}
+
+typedef int (*bench_op_t)(struct bench *bench, struct ext2 *ext2, u64 i, u64 *bytes, void *arg);
+
+static int bench_timed(struct bench *bench, const char *name, u64 ops, bench_op_t op, void *arg) {
+	/*** Runs ops operations on fresh ext2, timing each of them ***/
+	struct ext2 ext2;
+	struct bench_result result = { name, ops, 0, 0, calloc(ops ? ops : 1, sizeof(u64)), 0 };
+	if (!result.latency || bench_open(bench, &ext2)) {
+		free(result.latency);
+		return -1;
+	}
+	int res = 0;
+	u64 syscalls = bench_syscalls();
+	u64 start = bench_now_ns();
+	for (u64 i = 0; i < ops && !res; ++i) {
+		u64 t = bench_now_ns();
+		res = op(bench, &ext2, i, &result.bytes, arg);
+		result.latency[i] = bench_now_ns() - t;
+	}
+	result.seconds = (bench_now_ns() - start) / 1e9;
+	result.syscalls = bench_syscalls() - syscalls;
+	if (!res)
+		bench_report(bench, &ext2, &result);
+	ext2_close(&ext2);
+	free(result.latency);
+	return res;
+}
+
+static int bench_lookup(struct bench *bench, struct ext2 *ext2, u64 i, u64 *bytes, void *arg) {
+	(void)i, (void)bytes, (void)arg;
+	const struct bench_entry *entry = &bench->entries[rng_next(&bench->rng) % bench->count];
+	return ext2_lookup_path(ext2, entry->path) < 0 ? -1 : 0;
+}
+
+static int bench_list(struct bench *bench, struct ext2 *ext2, u64 i, u64 *bytes, void *arg) {
+	(void)bench, (void)bytes;
+	const u32 *dirs = arg;
+	struct ext2_dir_iter iter;
+	struct ext2_dirent dirent;
+	int res = ext2_dir_iter_new(&iter, ext2, dirs[i]);
+	if (!res)
+		while ((res = ext2_dir_iter_next(&iter, &dirent)) > 0)
+			;
+	ext2_dir_iter_end(&iter);
+	return res;
+}
+
+static int bench_seqread(struct bench *bench, struct ext2 *ext2, u64 i, u64 *bytes, void *arg) {
+	(void)bench;
+	const u32 *files = arg;
+	static u8 buf[EXT2_MAX_BLOCK_SIZE];
+	struct ext2_inode_blocks_iter iter;
+	int res = ext2_inode_blocks_iter_new(&iter, ext2, files[i]);
+	if (!res)
+		while ((res = ext2_inode_blocks_iter_next(&iter, buf)) > 0)
+			*bytes += res;
+	ext2_inode_blocks_iter_end(&iter);
+	return res;
+}
+
+#define RANDREAD_FILES		16
+#define RANDREAD_SIZE		4096
+
+struct randread {
+	struct ext2_file files[RANDREAD_FILES];
+	u32 count;
+};
+
+static int bench_randread(struct bench *bench, struct ext2 *ext2, u64 i, u64 *bytes, void *arg) {
+	(void)i;
+	struct randread *rr = arg;
+	static u8 buf[RANDREAD_SIZE];
+	if (!rr->count) { /*** Largest files, opened once on this ext2 ***/
+		for (u32 k = 0; k < bench->count && rr->count < RANDREAD_FILES; ++k) {
+			const struct bench_entry *entry = &bench->entries[k];
+			if (IFREG(entry->mode) && entry->size >= 4 * RANDREAD_SIZE && ext2_file_open(&rr->files[rr->count++], ext2, entry->ino))
+				return -1;
+		}
+		if (!rr->count) {
+			errno = ERR_FS_NOT_FOUND;
+			return -1;
+		}
+	}
+	struct ext2_file *file = &rr->files[rng_next(&bench->rng) % rr->count];
+	u64 offset = rng_next(&bench->rng) % (file->size / RANDREAD_SIZE) * RANDREAD_SIZE;
+	ssize_t res = ext2_file_pread(file, buf, RANDREAD_SIZE, offset);
+	if (res < 0)
+		return -1;
+	*bytes += res;
+	return 0;
+}
+
+static int bench_walk(struct bench *bench) {
+	struct ext2 ext2;
+	struct ext2_walk_stats stats;
+	if (bench_open(bench, &ext2))
+		return -1;
+	u64 syscalls = bench_syscalls();
+	int res = ext2_walk(&ext2, bench->nr_threads, bench_collect, bench, &stats);
+	syscalls = bench_syscalls() - syscalls;
+	if (!res) {
+		struct bench_result result = { "walk", stats.entries, 0, stats.seconds, NULL, syscalls };
+		bench_report(bench, &ext2, &result);
+	}
+	ext2_close(&ext2);
+	return res ? -1 : 0;
+}
+
+static int entry_size_cmp(const void *a, const void *b) {
+	const struct bench_entry *x = a, *y = b;
+	if (x->size != y->size)
+		return x->size > y->size ? -1 : 1;
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static int bench_run(struct bench *bench) {
+	/*** Walk also collects the entries other scenarios pick from ***/
+	printf("{\n  \"image\": \"%s\",\n  \"threads\": %u,\n  \"scenarios\": [", bench->image, bench->nr_threads);
+	bench->first = 1;
+	if (bench_walk(bench))
+		return -1;
+	/*** Walk order depends on threads, sorting makes random picks repeatable ***/
+	qsort(bench->entries, bench->count, sizeof(*bench->entries), entry_size_cmp);
+	u32 *dirs = malloc(bench->count * sizeof(u32));
+	u32 *files = malloc(bench->count * sizeof(u32));
+	u32 nr_dirs = 0, nr_files = 0;
+	if (!dirs || !files) {
+		free(dirs);
+		free(files);
+		return -1;
+	}
+	for (u32 i = 0; i < bench->count; ++i) {
+		if (ISDIR(bench->entries[i].mode))
+			dirs[nr_dirs++] = bench->entries[i].ino;
+		else if (IFREG(bench->entries[i].mode))
+			files[nr_files++] = bench->entries[i].ino;
+	}
+	struct randread rr = { .count = 0 };
+	int res = bench_timed(bench, "lookup", bench->ops, bench_lookup, NULL) ||
+		bench_timed(bench, "list", nr_dirs, bench_list, dirs) ||
+		bench_timed(bench, "seqread", nr_files, bench_seqread, files) ||
+		bench_timed(bench, "randread", bench->ops, bench_randread, &rr) ? -1 : 0;
+	for (u32 i = 0; i < rr.count; ++i)
+		ext2_file_close(&rr.files[i]);
+	printf("\n  ]\n}\n");
+	free(dirs);
+	free(files);
+	return res;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s mkimage [-b block_size] [-i inodes] [-f fanout] [-D depth] [-n files_per_dir] [-s min:max] [-x indirect_depth] [-S seed] image\n"
+		"       %s run [-n ops] [-j threads] [-c] [-S seed] image\n", name, name);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		usage(argv[0]);
+		return 2;
+	}
+	int opt;
+	optind = 2;
+	if (!strcmp(argv[1], "mkimage")) {
+		struct gen_opts opts = { 1024, 0, 4, 3, 16, 0, 64 << 10, 2, 1 };
+		while ((opt = getopt(argc, argv, "b:i:f:D:n:s:x:S:")) != -1) {
+			switch (opt) {
+			case 'b': opts.block_size = atoi(optarg); break;
+			case 'i': opts.inodes = atoi(optarg); break;
+			case 'f': opts.fanout = atoi(optarg); break;
+			case 'D': opts.depth = atoi(optarg); break;
+			case 'n': opts.files = atoi(optarg); break;
+			case 's':
+				if (sscanf(optarg, "%u:%u", &opts.min_size, &opts.max_size) != 2) {
+					usage(argv[0]);
+					return 2;
+				}
+				break;
+			case 'x': opts.indirect = atoi(optarg); break;
+			case 'S': opts.seed = strtoull(optarg, NULL, 0); break;
+			default: usage(argv[0]); return 2;
+			}
+		}
+		if (optind != argc - 1) {
+			usage(argv[0]);
+			return 2;
+		}
+		if (gen_image(argv[optind], &opts)) {
+			fprintf(stderr, "Error: %s\n", strerror(errno));
+			return 1;
+		}
+		return 0;
+	}
+	if (strcmp(argv[1], "run")) {
+		usage(argv[0]);
+		return 2;
+	}
+	struct bench bench;
+	memset(&bench, 0, sizeof(bench));
+	bench.ops = 100000;
+	bench.nr_threads = 1;
+	bench.rng = 1;
+	while ((opt = getopt(argc, argv, "n:j:cS:")) != -1) {
+		switch (opt) {
+		case 'n': bench.ops = strtoull(optarg, NULL, 0); break;
+		case 'j': bench.nr_threads = atoi(optarg); break;
+		case 'c': bench.cold = 1; break;
+		case 'S': bench.rng = strtoull(optarg, NULL, 0); break;
+		default: usage(argv[0]); return 2;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 2;
+	}
+	bench.image = argv[optind];
+	pthread_mutex_init(&bench.lock, NULL);
+	int res = bench_run(&bench);
+	if (res)
+		fprintf(stderr, "Error: %s\n", strerror(errno));
+	for (u32 i = 0; i < bench.count; ++i)
+		free(bench.entries[i].path);
+	free(bench.entries);
+	pthread_mutex_destroy(&bench.lock);
+	return res ? 1 : 0;
+}
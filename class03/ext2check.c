@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ext2.h"
+
+/*******************
+ * Read-only consistency check of ext2 image, a small part of e2fsck.
+ * Build: gcc -O2 -pthread -o ext2check ext2check.c ext2.c ext2_*.c
+ * Usage: ext2check [-j threads] image
+ *
+ * Pass 1 (groups in parallel): every inode in use claims its data, indirect and
+ * xattr blocks in a shared ownership bitmap with atomic fetch_or, so a block
+ * claimed twice shows up without locks. Shared xattr blocks may be claimed by
+ * many inodes. Pointers out of fs range are reported and not
+ * followed. Directories are read, rec_len chains are validated and every entry
+ * adds one to the reference count of its inode.
+ * Pass 2 (groups in parallel): block and inode bitmaps are compared with what
+ * pass 1 found, link counts are compared with references.
+ * Exit code is 0 for clean image, 1 for problems found, 2 for errors.
+ ******************/
+
+#define MAX_REPORTS		20 /* Printed problems of each kind */
+
+enum problem {
+	P_BAD_BLOCK,		/* Pointer out of fs */
+	P_DUP_BLOCK,		/* Block claimed twice */
+	P_BAD_DIR,		/* Malformed directory entries */
+	P_BAD_DIRENT_INO,	/* Entry points out of inode table */
+	P_BITMAP_FREE,		/* In use, but free in block bitmap */
+	P_BITMAP_USED,		/* Used in block bitmap, but nobody owns it */
+	P_INODE_BITMAP,		/* Inode bitmap disagrees with inode */
+	P_LINKS,		/* Link count differs from references */
+	P_COUNT
+};
+
+static const char *problem_names[P_COUNT] = {
+	"block pointers out of range",
+	"blocks claimed twice",
+	"malformed directories",
+	"entries with bad inode number",
+	"used blocks free in bitmap",
+	"unowned blocks used in bitmap",
+	"inode bitmap mismatches",
+	"wrong link counts",
+};
+
+struct check {
+	const struct ext2 *ext2;
+	u64 *owned;		/* Bit per block, set when claimed */
+	u64 *inode_used;	/* Bit per inode */
+	u32 *refs;		/* Directory references of each inode */
+	u16 *links;		/* links_count of each inode */
+	u32 next_group;		/* Next group to take */
+	u64 problems[P_COUNT];
+	int err;
+	pthread_mutex_t print_lock;
+};
+
+static void report(struct check *check, enum problem problem, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+static void report(struct check *check, enum problem problem, const char *fmt, ...) {
+	u64 n = __atomic_fetch_add(&check->problems[problem], 1, __ATOMIC_RELAXED);
+	if (n >= MAX_REPORTS)
+		return;
+	va_list args;
+	va_start(args, fmt);
+	pthread_mutex_lock(&check->print_lock);
+	vprintf(fmt, args);
+	putchar('\n');
+	pthread_mutex_unlock(&check->print_lock);
+	va_end(args);
+}
+
+static int bit_test_and_set(u64 *bitmap, u64 bit) {
+	u64 mask = 1ULL << (bit % 64);
+	return !!(__atomic_fetch_or(&bitmap[bit / 64], mask, __ATOMIC_RELAXED) & mask);
+}
+
+static int bit_test(const u64 *bitmap, u64 bit) {
+	return !!(__atomic_load_n(&bitmap[bit / 64], __ATOMIC_RELAXED) & (1ULL << (bit % 64)));
+}
+
+/*** Pass 1 ***/
+
+static int block_valid(const struct ext2 *ext2, u32 block_no) {
+	return block_no >= ext2->first_data_block && block_no < ext2->blocks_count;
+}
+
+static void claim(struct check *check, u32 block_no, u32 ino) {
+	if (bit_test_and_set(check->owned, block_no))
+		report(check, P_DUP_BLOCK, "block %u of inode %u is claimed twice", block_no, ino);
+}
+
+static void claim_range(struct check *check, u32 first, u32 count) {
+	for (u32 i = 0; i < count; ++i)
+		claim(check, first + i, 0);
+}
+
+static u32 inode_table_blocks(const struct ext2 *ext2) {
+	return ((u64)ext2->inodes_per_group * ext2->inode_size + ext2->blocksize - 1) / ext2->blocksize;
+}
+
+static int inode_table_valid(const struct ext2 *ext2, u32 group) {
+	u32 table = ext2->groups.inode_table[group];
+	return block_valid(ext2, table) && (u64)table + inode_table_blocks(ext2) <= ext2->blocks_count;
+}
+
+static void claim_group_metadata(struct check *check, u32 group) {
+	/*** Descriptor blocks out of fs are reported and not claimed, passes skip what they point to ***/
+	const struct ext2 *ext2 = check->ext2;
+	u32 first = ext2->first_data_block + group * ext2->blocks_per_group;
+	if (ext2_group_has_super(ext2, group))
+		claim_range(check, first, 1 + ext2->gdt_blocks + ext2->reserved_gdt_blocks);
+	if (block_valid(ext2, ext2->groups.block_bitmap[group]))
+		claim(check, ext2->groups.block_bitmap[group], 0);
+	else
+		report(check, P_BAD_BLOCK, "group %u: block bitmap %u out of fs", group, ext2->groups.block_bitmap[group]);
+	if (block_valid(ext2, ext2->groups.inode_bitmap[group]))
+		claim(check, ext2->groups.inode_bitmap[group], 0);
+	else
+		report(check, P_BAD_BLOCK, "group %u: inode bitmap %u out of fs", group, ext2->groups.inode_bitmap[group]);
+	if (inode_table_valid(ext2, group))
+		claim_range(check, ext2->groups.inode_table[group], inode_table_blocks(ext2));
+	else
+		report(check, P_BAD_BLOCK, "group %u: inode table %u out of fs", group, ext2->groups.inode_table[group]);
+}
+
+static int claim_tree(struct check *check, u32 ino, u32 block_no, int depth, u32 *scratch) {
+	/*** Claims indirect block of given depth and everything below it ***/
+	/*** Returns 1 when some pointer was out of fs, -1 and sets errno on error ***/
+	const struct ext2 *ext2 = check->ext2;
+	if (!block_no)
+		return 0;
+	if (!block_valid(ext2, block_no)) {
+		report(check, P_BAD_BLOCK, "inode %u points to block %u out of fs", ino, block_no);
+		return 1;
+	}
+	claim(check, block_no, ino);
+	if (!depth)
+		return 0;
+	u32 per_block = ext2->blocksize / sizeof(u32);
+	if (ext2_read_block_map(ext2, block_no, scratch))
+		return -1;
+	int bad = 0;
+	for (u32 i = 0; i < per_block; ++i) {
+		int res = claim_tree(check, ino, scratch[i], depth - 1, scratch + per_block);
+		if (res < 0)
+			return -1;
+		bad |= res;
+	}
+	return bad;
+}
+
+static int has_block_pointers(const struct ext2 *ext2, u16 mode, u32 blocks, u32 file_acl) {
+	/*** Devices keep numbers and fast symlinks keep target in i_block ***/
+	u16 fmt = mode & EXT2_S_IFMT;
+	if (fmt == EXT2_S_IFCHR || fmt == EXT2_S_IFBLK || fmt == EXT2_S_IFIFO || fmt == EXT2_S_IFSOCK)
+		return 0;
+	/*** Extended attribute block counts in i_blocks too ***/
+	u32 acl_sectors = file_acl ? ext2->blocksize / 512 : 0;
+	if (fmt == EXT2_S_IFLNK && blocks == acl_sectors)
+		return 0;
+	return 1;
+}
+
+static void claim_xattr(struct check *check, u32 ino, u32 block_no) {
+	/*** Inodes with same attributes share one refcounted block, so it may be claimed again ***/
+	if (!block_no)
+		return;
+	if (!block_valid(check->ext2, block_no)) {
+		report(check, P_BAD_BLOCK, "inode %u points to xattr block %u out of fs", ino, block_no);
+		return;
+	}
+	bit_test_and_set(check->owned, block_no);
+}
+
+static int check_dir(struct check *check, u32 ino, int bad_blocks) {
+	/*** With bad_blocks pass 1 reported pointers out of fs, reading them fails with any error ***/
+	const struct ext2 *ext2 = check->ext2;
+	struct ext2_dir_iter iter;
+	struct ext2_dirent dirent;
+	int res = ext2_dir_iter_new(&iter, ext2, ino);
+	if (res)
+		goto out_check_dir;
+	while ((res = ext2_dir_iter_next(&iter, &dirent)) > 0) {
+		if (dirent.inode > ext2->inodes_count) {
+			report(check, P_BAD_DIRENT_INO, "directory %u: entry '%.*s' points to inode %u out of fs", ino, dirent.name_len, dirent.name, dirent.inode);
+			continue;
+		}
+		__atomic_add_fetch(&check->refs[dirent.inode], 1, __ATOMIC_RELAXED);
+	}
+	if (res < 0 && errno == ERR_FS_CORRUPT) {
+		report(check, P_BAD_DIR, "directory %u: malformed entry in block %u", ino, iter.block_index - 1);
+		res = 0;
+	} else if (res < 0 && bad_blocks) {
+		report(check, P_BAD_DIR, "directory %u: unreadable: %s", ino, ext2_strerror(errno));
+		res = 0;
+	}
+out_check_dir:
+	ext2_dir_iter_end(&iter);
+	return res;
+}
+
+static int check_group_inodes(struct check *check, u32 group, u32 *scratch) {
+	const struct ext2 *ext2 = check->ext2;
+	struct ext2_inode_scan scan;
+	int res = ext2_inode_scan_new(&scan, ext2, 0);
+	if (res)
+		return res;
+	if (!inode_table_valid(ext2, group)) /*** Already reported ***/
+		goto out_check_group_inodes;
+	ext2_inode_scan_range(&scan, group, group + 1);
+	const struct ext2_inode_batch *batch = &scan.batch;
+	while ((res = ext2_inode_scan_next(&scan)) > 0) {
+		for (u32 i = 0; i < batch->count; ++i) {
+			u32 ino = batch->first_ino + i;
+			if (ino > ext2->inodes_count)
+				break;
+			check->links[ino] = batch->links_count[i];
+			int in_use = batch->links_count[i] && !batch->dtime[i];
+			/*** Reserved inodes are always marked used ***/
+			if (in_use || ino < ext2->first_ino)
+				bit_test_and_set(check->inode_used, ino);
+			if (!in_use && (ino != 1 || !batch->blocks[i])) /*** Bad blocks inode has no links ***/
+				continue;
+			const u32 *blocks = batch->block + (size_t)i * EXT2_N_BLOCKS;
+			if (ino == EXT2_RESIZE_INO) { /*** Below its double indirect block are reserved GDT blocks, already owned ***/
+				claim_tree(check, ino, blocks[EXT2_DIND_BLOCK], 0, scratch);
+				continue;
+			}
+			claim_xattr(check, ino, batch->file_acl[i]);
+			if (!has_block_pointers(ext2, batch->mode[i], batch->blocks[i], batch->file_acl[i]))
+				continue;
+			int err = 0, bad = 0;
+			for (int b = 0; b < EXT2_N_BLOCKS && !err; ++b) {
+				int claimed = claim_tree(check, ino, blocks[b], b < EXT2_NDIR_BLOCKS ? 0 : b - EXT2_NDIR_BLOCKS + 1, scratch);
+				if (claimed < 0)
+					err = -1;
+				else
+					bad |= claimed;
+			}
+			if (!err && in_use && ISDIR(batch->mode[i]))
+				err = check_dir(check, ino, bad);
+			if (err) {
+				res = -1;
+				goto out_check_group_inodes;
+			}
+		}
+	}
+out_check_group_inodes:
+	ext2_inode_scan_end(&scan);
+	return res;
+}
+
+/*** Pass 2 ***/
+
+static int check_group_bitmaps(struct check *check, u32 group) {
+	const struct ext2 *ext2 = check->ext2;
+	u8 *bitmap = malloc(ext2->blocksize);
+	if (!bitmap)
+		return -1;
+	/*** Blocks ***/
+	u64 group_first = (u64)group * ext2->blocks_per_group;
+	u64 data_blocks = ext2->blocks_count - ext2->first_data_block;
+	u32 nblocks = data_blocks - group_first < ext2->blocks_per_group ? data_blocks - group_first : ext2->blocks_per_group;
+	int block_bitmap = block_valid(ext2, ext2->groups.block_bitmap[group]);
+	if (block_bitmap && ext2_io_read(ext2, bitmap, ext2->blocksize, (u64)ext2->groups.block_bitmap[group] * ext2->blocksize))
+		goto err_check_group_bitmaps;
+	for (u32 i = 0; block_bitmap && i < nblocks; ++i) {
+		u32 block_no = ext2->first_data_block + group_first + i;
+		int used = !!(bitmap[i / 8] & (1u << (i % 8)));
+		int owned = bit_test(check->owned, block_no);
+		if (owned && !used)
+			report(check, P_BITMAP_FREE, "block %u is in use but free in bitmap", block_no);
+		else if (used && !owned)
+			report(check, P_BITMAP_USED, "block %u is marked used but not owned", block_no);
+	}
+	/*** Inodes and links ***/
+	int inode_bitmap = block_valid(ext2, ext2->groups.inode_bitmap[group]);
+	if (inode_bitmap && ext2_io_read(ext2, bitmap, ext2->blocksize, (u64)ext2->groups.inode_bitmap[group] * ext2->blocksize))
+		goto err_check_group_bitmaps;
+	for (u32 i = 0; i < ext2->inodes_per_group; ++i) {
+		u32 ino = group * ext2->inodes_per_group + i + 1;
+		if (ino > ext2->inodes_count)
+			break;
+		int marked = inode_bitmap && !!(bitmap[i / 8] & (1u << (i % 8)));
+		int in_use = bit_test(check->inode_used, ino);
+		if (inode_bitmap && marked != in_use)
+			report(check, P_INODE_BITMAP, "inode %u is %s but %s in bitmap", ino, in_use ? "in use" : "free", marked ? "used" : "free");
+		if (in_use && (ino == EXT2_ROOT_INO || ino >= ext2->first_ino) && check->links[ino] != check->refs[ino])
+			report(check, P_LINKS, "inode %u has link count %u, referenced %u times", ino, check->links[ino], check->refs[ino]);
+	}
+	free(bitmap);
+	return 0;
+err_check_group_bitmaps:
+	free(bitmap);
+	return -1;
+}
+
+/*** Workers take groups one by one ***/
+
+struct worker_arg {
+	struct check *check;
+	int pass;
+};
+
+static void *check_worker(void *arg) {
+	struct worker_arg *warg = arg;
+	struct check *check = warg->check;
+	const struct ext2 *ext2 = check->ext2;
+	u32 *scratch = malloc(3 * ext2->blocksize);
+	if (!scratch) {
+		__atomic_store_n(&check->err, ENOMEM, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	for (;;) {
+		u32 group = __atomic_fetch_add(&check->next_group, 1, __ATOMIC_RELAXED);
+		if (group >= ext2->groups_count || __atomic_load_n(&check->err, __ATOMIC_RELAXED))
+			break;
+		int res = warg->pass == 1 ? check_group_inodes(check, group, scratch) : check_group_bitmaps(check, group);
+		if (res) {
+			__atomic_store_n(&check->err, errno, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	free(scratch);
+	return NULL;
+}
+
+static int run_pass(struct check *check, int pass, u32 nr_threads) {
+	pthread_t *threads = malloc(nr_threads * sizeof(*threads));
+	if (!threads)
+		return -1;
+	struct worker_arg arg = { check, pass };
+	check->next_group = 0;
+	u32 started = 0;
+	for (; started < nr_threads; ++started)
+		if (pthread_create(&threads[started], NULL, check_worker, &arg))
+			break;
+	for (u32 i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	if (!started) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (check->err) {
+		errno = check->err;
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-j threads] image\n", name);
+}
+
+int main(int argc, char **argv) {
+	long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		if (opt == 'j')
+			nr_threads = atol(optarg);
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc - 1 || nr_threads < 1) {
+		usage(argv[0]);
+		return 2;
+	}
+	int res;
+	struct ext2 ext2;
+	res = ext2_open(&ext2, argv[optind]);
+	if (res) {
+		printf("Error: %s\n", ext2_strerror(errno));
+		return 2;
+	}
+	struct check check;
+	memset(&check, 0, sizeof(check));
+	check.ext2 = &ext2;
+	pthread_mutex_init(&check.print_lock, NULL);
+	check.owned = calloc(ext2.blocks_count / 64 + 1, sizeof(u64));
+	check.inode_used = calloc(ext2.inodes_count / 64 + 1, sizeof(u64));
+	check.refs = calloc((size_t)ext2.inodes_count + 1, sizeof(u32));
+	check.links = calloc((size_t)ext2.inodes_count + 1, sizeof(u16));
+	res = 2;
+	if (!check.owned || !check.inode_used || !check.refs || !check.links) {
+		printf("Error: %s\n", strerror(ENOMEM));
+		goto out_main;
+	}
+	for (u32 group = 0; group < ext2.groups_count; ++group)
+		claim_group_metadata(&check, group);
+	if (run_pass(&check, 1, nr_threads) || run_pass(&check, 2, nr_threads)) {
+		printf("Error: %s\n", ext2_strerror(errno));
+		goto out_main;
+	}
+	u64 total = 0;
+	for (int i = 0; i < P_COUNT; ++i) {
+		if (check.problems[i])
+			printf("%llu %s\n", (unsigned long long)check.problems[i], problem_names[i]);
+		total += check.problems[i];
+	}
+	printf("%s: %s\n", argv[optind], total ? "problems found" : "clean");
+	res = total ? 1 : 0;
+out_main:
+	free(check.owned);
+	free(check.inode_used);
+	free(check.refs);
+	free(check.links);
+	pthread_mutex_destroy(&check.print_lock);
+	ext2_close(&ext2);
+	return res;
+}
@@ -0,0 +1,707 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <endian.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ext2.h"
+
+/*******************
+ * Reader service: one process keeps many images open and answers clients
+ * over a Unix domain socket, so short-lived tools get warm block and dentry
+ * caches instead of opening and parsing every image again.
+ * Build: gcc -O2 -pthread -o ext2d ext2d.c ext2.c ext2_*.c
+ * Usage: ext2d serve [-j workers] [-m cache_mb] [-M] socket image...
+ *        ext2d stat|ls|cat socket image path
+ *
+ * Workers wait on one epoll set. Connections are armed with EPOLLONESHOT, so
+ * a connection is handled by a single worker at a time and needs no lock, and
+ * a slow disk read blocks only the worker doing it. -m is the block cache
+ * budget of all images together, -M maps the images.
+ *
+ * Protocol, all integers little-endian: a client sends struct ext2d_req
+ * followed by len bytes of payload, the server answers every request in order
+ * with struct ext2d_reply and len bytes of payload. Requests may be pipelined,
+ * tag is copied to the reply. Status is 0, or errno value the library set
+ * (ERR_FS_* or positive errno), then the payload is empty.
+ *   OPEN    payload: image path as given to serve or its real path.
+ *           reply: le32 image id for the image field of other requests.
+ *   STAT    ino. reply: struct ext2d_stat.
+ *   LOOKUP  ino: directory to start from, 0 for root. payload: path, symlinks
+ *           are not followed. reply: struct ext2d_stat.
+ *   LIST    ino, offset: 0 or cookie from previous LIST, count: reply size.
+ *           reply: le64 next cookie (EXT2D_LIST_END at the end), entries of
+ *           le32 ino, u8 file_type, u8 name_len and name.
+ *   READ    ino, offset, count up to EXT2D_MAX_READ. reply: data, shorter
+ *           at the end of file. Symlinks read as their target.
+ ******************/
+
+#define EXT2D_OP_OPEN		1
+#define EXT2D_OP_STAT		2
+#define EXT2D_OP_LOOKUP		3
+#define EXT2D_OP_LIST		4
+#define EXT2D_OP_READ		5
+
+#define EXT2D_MAX_PATH		4096
+#define EXT2D_MAX_READ		(1 << 20)
+#define EXT2D_MAX_LIST		(64 << 10)
+#define EXT2D_LIST_END		(~0ULL)
+#define EXT2D_LIST_ENTRY	6 /* Entry without name */
+#define EXT2D_SEND_TIMEOUT	5000 /* ms a client may keep us waiting on a reply */
+
+struct ext2d_req {
+	__le32 len;		/* Payload bytes after header */
+	__le32 tag;
+	__le16 op;
+	__le16 image;
+	__le32 ino;
+	__le64 offset;
+	__le32 count;
+	__le32 reserved;
+};
+
+struct ext2d_reply {
+	__le32 len;
+	__le32 tag;
+	__le32 status;
+	__le32 reserved;
+};
+
+struct ext2d_stat {
+	__le32 ino;
+	__le16 mode;
+	__le16 links_count;
+	__le32 uid;
+	__le32 gid;
+	__le64 size;
+	__le32 atime;
+	__le32 mtime;
+	__le32 ctime;
+	__le32 blocks;
+};
+
+/*** Server ***/
+
+struct image {
+	const char *name;	/* As given on command line */
+	char *real_name;
+	struct ext2 ext2;
+};
+
+struct conn {
+	struct conn *prev, *next;
+	int fd;
+	u32 in_len;
+	u8 in[sizeof(struct ext2d_req) + EXT2D_MAX_PATH];
+	/*** File of last READ, sequential reads keep its indirect blocks ***/
+	int file_image;		/* -1 for none */
+	struct ext2_file file;
+};
+
+struct server {
+	struct image *images;
+	u32 nr_images;
+	int listen_fd;
+	int stop_fd;		/* eventfd, readable once server stops */
+	int epoll_fd;
+	int stop;
+	pthread_mutex_t lock;	/* Protects list of connections */
+	struct conn *conns;
+};
+
+struct worker {
+	struct server *server;
+	pthread_t thread;
+	u8 *out;		/* Reply header and payload */
+};
+
+static int send_all(int fd, const void *buf, size_t len) {
+	const u8 *p = buf;
+	while (len) {
+		ssize_t res = send(fd, p, len, MSG_NOSIGNAL);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return -1;
+			/*** Client doesn't read its replies fast enough ***/
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+			if (poll(&pfd, 1, EXT2D_SEND_TIMEOUT) <= 0)
+				return -1;
+			continue;
+		}
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static void stat_fill(struct ext2d_stat *st, u32 ino, const struct ext2_inode *inode) {
+	st->ino = htole32(ino);
+	st->mode = htole16(inode->i_mode);
+	st->links_count = htole16(inode->i_links_count);
+	st->uid = htole32(inode->i_uid);
+	st->gid = htole32(inode->i_gid);
+	st->size = htole64(ext2_inode_size(inode));
+	st->atime = htole32(inode->i_atime);
+	st->mtime = htole32(inode->i_mtime);
+	st->ctime = htole32(inode->i_ctime);
+	st->blocks = htole32(inode->i_blocks);
+}
+
+static int fast_symlink(const struct ext2 *ext2, const struct ext2_inode *inode) {
+	/*** Target kept in i_block when no data block is allocated ***/
+	u32 acl_sectors = inode->i_file_acl ? ext2->blocksize / 512 : 0;
+	return ISLNK(inode->i_mode) && inode->i_blocks == acl_sectors;
+}
+
+static int do_open(struct server *server, const char *path, u8 *out) {
+	char real_name[PATH_MAX];
+	int resolved = realpath(path, real_name) != NULL;
+	for (u32 i = 0; i < server->nr_images; ++i) {
+		struct image *image = &server->images[i];
+		if (!strcmp(path, image->name) || (resolved && !strcmp(real_name, image->real_name))) {
+			u32 id = htole32(i);
+			memcpy(out, &id, sizeof(id));
+			return sizeof(id);
+		}
+	}
+	errno = ERR_FS_NOT_FOUND;
+	return -1;
+}
+
+static int do_stat(const struct ext2 *ext2, u32 ino, u8 *out) {
+	struct ext2_inode inode;
+	struct ext2d_stat st;
+	if (read_inode(ext2, &inode, ino))
+		return -1;
+	stat_fill(&st, ino, &inode);
+	memcpy(out, &st, sizeof(st));
+	return sizeof(st);
+}
+
+static int do_lookup(const struct ext2 *ext2, u32 ino, const char *path, u8 *out) {
+	/*** Component by component through dentry cache ***/
+	int dir = ino ? (int)ino : EXT2_ROOT_INO;
+	while (*path) {
+		const char *end = strchrnul(path, '/');
+		if (end != path) {
+			dir = ext2_lookup(ext2, dir, path, end - path);
+			if (dir < 0)
+				return -1;
+			if (!dir) {
+				errno = ERR_FS_NOT_FOUND;
+				return -1;
+			}
+		}
+		path = *end ? end + 1 : end;
+	}
+	return do_stat(ext2, dir, out);
+}
+
+static int do_list(const struct ext2 *ext2, u32 ino, u64 cookie, u32 count, u8 *out) {
+	struct ext2_dir_iter iter;
+	struct ext2_dirent dirent;
+	if (count > EXT2D_MAX_LIST)
+		count = EXT2D_MAX_LIST;
+	/*** Room for at least one entry, or client never gets anywhere ***/
+	if (count < sizeof(u64) + EXT2D_LIST_ENTRY + EXT2_NAME_LEN) {
+		errno = EINVAL;
+		return -1;
+	}
+	int res = ext2_dir_iter_new(&iter, ext2, ino);
+	if (!res && cookie)
+		res = ext2_dir_iter_seek(&iter, cookie);
+	u32 len = sizeof(u64);
+	u64 next = EXT2D_LIST_END;
+	while (!res) {
+		u64 pos = ext2_dir_iter_tell(&iter);
+		res = ext2_dir_iter_next(&iter, &dirent);
+		if (res <= 0)
+			break;
+		res = 0;
+		if (len + EXT2D_LIST_ENTRY + dirent.name_len > count) {
+			next = pos;
+			break;
+		}
+		u32 entry_ino = htole32(dirent.inode);
+		memcpy(out + len, &entry_ino, sizeof(entry_ino));
+		out[len + 4] = dirent.file_type;
+		out[len + 5] = dirent.name_len;
+		memcpy(out + len + EXT2D_LIST_ENTRY, dirent.name, dirent.name_len);
+		len += EXT2D_LIST_ENTRY + dirent.name_len;
+	}
+	ext2_dir_iter_end(&iter);
+	if (res < 0)
+		return -1;
+	next = htole64(next);
+	memcpy(out, &next, sizeof(next));
+	return len;
+}
+
+static int do_read(struct conn *conn, u32 image_id, const struct ext2 *ext2, u32 ino, u64 offset, u32 count, u8 *out) {
+	struct ext2_file *file = &conn->file;
+	if (count > EXT2D_MAX_READ)
+		count = EXT2D_MAX_READ;
+	if (conn->file_image != (int)image_id || file->ino != ino) {
+		if (conn->file_image >= 0)
+			ext2_file_close(file);
+		conn->file_image = -1;
+		if (ext2_file_open(file, ext2, ino)) {
+			ext2_file_close(file);
+			return -1;
+		}
+		conn->file_image = image_id;
+	}
+	if (ISDIR(file->inode.i_mode)) {
+		errno = EISDIR;
+		return -1;
+	}
+	if (fast_symlink(ext2, &file->inode)) {
+		if (file->size > sizeof(file->inode.i_block)) {
+			errno = ERR_FS_CORRUPT;
+			return -1;
+		}
+		if (offset >= file->size)
+			return 0;
+		if (count > file->size - offset)
+			count = file->size - offset;
+		memcpy(out, (const u8 *)file->inode.i_block + offset, count);
+		return count;
+	}
+	return ext2_file_pread(file, out, count, offset);
+}
+
+static int conn_request(struct worker *worker, struct conn *conn, const struct ext2d_req *req, const u8 *payload) {
+	/*** Answers one request, -1 when connection has to be dropped ***/
+	struct server *server = worker->server;
+	struct ext2d_reply reply;
+	u8 *out = worker->out + sizeof(reply);
+	u32 len = le32toh(req->len);
+	u16 op = le16toh(req->op);
+	u16 image_id = le16toh(req->image);
+	u32 ino = le32toh(req->ino);
+	u64 offset = le64toh(req->offset);
+	u32 count = le32toh(req->count);
+	char path[EXT2D_MAX_PATH + 1];
+	memcpy(path, payload, len);
+	path[len] = '\0';
+	const struct ext2 *ext2 = image_id < server->nr_images ? &server->images[image_id].ext2 : NULL;
+	int res;
+	if (op != EXT2D_OP_OPEN && !ext2) {
+		errno = EBADF;
+		res = -1;
+	} else {
+		switch (op) {
+		case EXT2D_OP_OPEN: res = do_open(server, path, out); break;
+		case EXT2D_OP_STAT: res = do_stat(ext2, ino, out); break;
+		case EXT2D_OP_LOOKUP: res = do_lookup(ext2, ino, path, out); break;
+		case EXT2D_OP_LIST: res = do_list(ext2, ino, offset, count, out); break;
+		case EXT2D_OP_READ: res = do_read(conn, image_id, ext2, ino, offset, count, out); break;
+		default: errno = ENOSYS; res = -1; break;
+		}
+	}
+	reply.len = htole32(res < 0 ? 0 : res);
+	reply.tag = req->tag;
+	reply.status = htole32(res < 0 ? (u32)errno : 0);
+	reply.reserved = 0;
+	memcpy(worker->out, &reply, sizeof(reply));
+	return send_all(conn->fd, worker->out, sizeof(reply) + (res < 0 ? 0 : res));
+}
+
+static void conn_close(struct server *server, struct conn *conn) {
+	pthread_mutex_lock(&server->lock);
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		server->conns = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	pthread_mutex_unlock(&server->lock);
+	if (conn->file_image >= 0)
+		ext2_file_close(&conn->file);
+	close(conn->fd);
+	free(conn);
+}
+
+static void conn_event(struct worker *worker, struct conn *conn) {
+	/*** Answers every complete request, then waits for more ***/
+	struct server *server = worker->server;
+	int done = 0;
+	while (!done) {
+		ssize_t n = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				done = -1;
+			break;
+		}
+		if (n == 0) /*** Client is done, requests already here still get replies ***/
+			done = 1;
+		conn->in_len += n;
+		u32 used = 0;
+		while (conn->in_len - used >= sizeof(struct ext2d_req)) {
+			struct ext2d_req req;
+			memcpy(&req, conn->in + used, sizeof(req));
+			u32 len = le32toh(req.len);
+			if (len > EXT2D_MAX_PATH) { /*** Not our protocol ***/
+				done = -1;
+				break;
+			}
+			if (conn->in_len - used < sizeof(req) + len)
+				break;
+			if (conn_request(worker, conn, &req, conn->in + used + sizeof(req))) {
+				done = -1;
+				break;
+			}
+			used += sizeof(req) + len;
+		}
+		memmove(conn->in, conn->in + used, conn->in_len - used);
+		conn->in_len -= used;
+	}
+	if (done) {
+		conn_close(server, conn);
+		return;
+	}
+	struct epoll_event ev = { EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, { .ptr = conn } };
+	if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev))
+		conn_close(server, conn);
+}
+
+static void server_accept(struct server *server) {
+	for (;;) {
+		int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		struct conn *conn = malloc(sizeof(*conn));
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->in_len = 0;
+		conn->file_image = -1;
+		conn->prev = NULL;
+		pthread_mutex_lock(&server->lock);
+		conn->next = server->conns;
+		if (server->conns)
+			server->conns->prev = conn;
+		server->conns = conn;
+		pthread_mutex_unlock(&server->lock);
+		struct epoll_event ev = { EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, { .ptr = conn } };
+		if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+			conn_close(server, conn);
+	}
+	struct epoll_event ev = { EPOLLIN | EPOLLONESHOT, { .ptr = &server->listen_fd } };
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, server->listen_fd, &ev);
+}
+
+static void *worker_main(void *arg) {
+	struct worker *worker = arg;
+	struct server *server = worker->server;
+	struct epoll_event ev;
+	while (!__atomic_load_n(&server->stop, __ATOMIC_ACQUIRE)) {
+		int n = epoll_wait(server->epoll_fd, &ev, 1, -1);
+		if (n <= 0)
+			continue;
+		if (ev.data.ptr == &server->stop_fd)
+			break;
+		if (ev.data.ptr == &server->listen_fd)
+			server_accept(server);
+		else
+			conn_event(worker, ev.data.ptr);
+	}
+	return NULL;
+}
+
+static int server_listen(const char *socket_path) {
+	struct sockaddr_un addr;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	unlink(socket_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int serve(const char *socket_path, char **names, u32 nr_images, u32 nr_workers, size_t cache_size, int backend) {
+	struct server server;
+	struct worker *workers = NULL;
+	u32 nr_open = 0, nr_started = 0;
+	int res = -1;
+	memset(&server, 0, sizeof(server));
+	server.listen_fd = server.stop_fd = server.epoll_fd = -1;
+	pthread_mutex_init(&server.lock, NULL);
+	server.images = calloc(nr_images, sizeof(*server.images));
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!server.images || !workers)
+		goto out_serve;
+	/*** Images share the cache budget ***/
+	struct ext2_opts opts = { cache_size / nr_images, backend, 0 };
+	for (; nr_open < nr_images; ++nr_open) {
+		struct image *image = &server.images[nr_open];
+		image->name = names[nr_open];
+		image->real_name = realpath(image->name, NULL);
+		if (!image->real_name || ext2_open_opts(&image->ext2, image->name, &opts)) {
+			fprintf(stderr, "Can't open image %s\n", image->name);
+			free(image->real_name);
+			goto out_serve;
+		}
+	}
+	server.nr_images = nr_images;
+	/*** Signals go to main thread only ***/
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	server.listen_fd = server_listen(socket_path);
+	server.stop_fd = eventfd(0, EFD_CLOEXEC);
+	server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (server.listen_fd < 0 || server.stop_fd < 0 || server.epoll_fd < 0)
+		goto out_serve;
+	struct epoll_event ev = { EPOLLIN | EPOLLONESHOT, { .ptr = &server.listen_fd } };
+	if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &ev))
+		goto out_serve;
+	/*** Level triggered without oneshot, wakes every worker ***/
+	ev.events = EPOLLIN;
+	ev.data.ptr = &server.stop_fd;
+	if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.stop_fd, &ev))
+		goto out_serve;
+	for (; nr_started < nr_workers; ++nr_started) {
+		workers[nr_started].server = &server;
+		workers[nr_started].out = malloc(sizeof(struct ext2d_reply) + EXT2D_MAX_READ);
+		if (!workers[nr_started].out || pthread_create(&workers[nr_started].thread, NULL, worker_main, &workers[nr_started])) {
+			free(workers[nr_started].out);
+			goto out_serve;
+		}
+	}
+	fprintf(stderr, "Serving %u images on %s with %u workers\n", nr_images, socket_path, nr_workers);
+	int sig;
+	sigwait(&signals, &sig);
+	res = 0;
+out_serve:;
+	int err = errno;
+	__atomic_store_n(&server.stop, 1, __ATOMIC_RELEASE);
+	if (server.stop_fd >= 0) {
+		u64 one = 1;
+		if (write(server.stop_fd, &one, sizeof(one)) != sizeof(one))
+			res = -1;
+	}
+	for (u32 i = 0; i < nr_started; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		free(workers[i].out);
+	}
+	while (server.conns)
+		conn_close(&server, server.conns);
+	if (server.listen_fd >= 0) {
+		close(server.listen_fd);
+		unlink(socket_path);
+	}
+	if (server.epoll_fd >= 0)
+		close(server.epoll_fd);
+	if (server.stop_fd >= 0)
+		close(server.stop_fd);
+	for (u32 i = 0; i < nr_open; ++i) {
+		ext2_close(&server.images[i].ext2);
+		free(server.images[i].real_name);
+	}
+	free(server.images);
+	free(workers);
+	pthread_mutex_destroy(&server.lock);
+	errno = err;
+	return res;
+}
+
+/*** Client ***/
+
+static int recv_all(int fd, void *buf, size_t len) {
+	u8 *p = buf;
+	while (len) {
+		ssize_t res = recv(fd, p, len, 0);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0) {
+			if (res == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static int client_connect(const char *socket_path) {
+	struct sockaddr_un addr;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int client_call(int fd, u16 op, u16 image, u32 ino, u64 offset, u32 count, const char *path, void *out, u32 out_size) {
+	/*** Returns payload length, or -1 and sets errno to status ***/
+	struct ext2d_req req;
+	struct ext2d_reply reply;
+	u32 len = path ? strlen(path) : 0;
+	if (len > EXT2D_MAX_PATH) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	req.len = htole32(len);
+	req.op = htole16(op);
+	req.image = htole16(image);
+	req.ino = htole32(ino);
+	req.offset = htole64(offset);
+	req.count = htole32(count);
+	if (send_all(fd, &req, sizeof(req)) || send_all(fd, path, len) || recv_all(fd, &reply, sizeof(reply)))
+		return -1;
+	len = le32toh(reply.len);
+	if (len > out_size) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (recv_all(fd, out, len))
+		return -1;
+	if (reply.status) {
+		errno = (int)le32toh(reply.status);
+		return -1;
+	}
+	return len;
+}
+
+static int client(const char *cmd, const char *socket_path, const char *image_name, const char *path) {
+	int res = -1;
+	u8 *buf = malloc(EXT2D_MAX_READ);
+	int fd = client_connect(socket_path);
+	if (!buf || fd < 0)
+		goto out_client;
+	u32 image;
+	struct ext2d_stat st;
+	if (client_call(fd, EXT2D_OP_OPEN, 0, 0, 0, 0, image_name, &image, sizeof(image)) < 0 ||
+			client_call(fd, EXT2D_OP_LOOKUP, le32toh(image), 0, 0, 0, path, &st, sizeof(st)) < 0)
+		goto out_client;
+	image = le32toh(image);
+	u32 ino = le32toh(st.ino);
+	if (!strcmp(cmd, "stat")) {
+		printf("ino %u mode %o links %u uid %u gid %u size %llu atime %u mtime %u ctime %u blocks %u\n",
+			ino, le16toh(st.mode), le16toh(st.links_count), le32toh(st.uid), le32toh(st.gid),
+			(unsigned long long)le64toh(st.size), le32toh(st.atime), le32toh(st.mtime), le32toh(st.ctime), le32toh(st.blocks));
+		res = 0;
+	} else if (!strcmp(cmd, "ls")) {
+		u64 cookie = 0;
+		while (cookie != EXT2D_LIST_END) {
+			int len = client_call(fd, EXT2D_OP_LIST, image, ino, cookie, EXT2D_MAX_LIST, NULL, buf, EXT2D_MAX_LIST);
+			if (len < (int)sizeof(cookie))
+				goto out_client;
+			memcpy(&cookie, buf, sizeof(cookie));
+			cookie = le64toh(cookie);
+			for (int pos = sizeof(cookie); pos + EXT2D_LIST_ENTRY <= len; pos += EXT2D_LIST_ENTRY + buf[pos + 5]) {
+				u32 entry_ino;
+				memcpy(&entry_ino, buf + pos, sizeof(entry_ino));
+				printf("%u %.*s\n", le32toh(entry_ino), buf[pos + 5], buf + pos + EXT2D_LIST_ENTRY);
+			}
+		}
+		res = 0;
+	} else if (!strcmp(cmd, "cat")) {
+		u64 offset = 0;
+		int len;
+		while ((len = client_call(fd, EXT2D_OP_READ, image, ino, offset, EXT2D_MAX_READ, NULL, buf, EXT2D_MAX_READ)) > 0) {
+			if (fwrite(buf, 1, len, stdout) != (size_t)len)
+				goto out_client;
+			offset += len;
+		}
+		res = len;
+	} else {
+		errno = EINVAL;
+	}
+out_client:
+	if (res)
+		fprintf(stderr, "Error: %s\n", strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return res;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s serve [-j workers] [-m cache_mb] [-M] socket image...\n"
+		"       %s stat|ls|cat socket image path\n", name, name);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (strcmp(argv[1], "serve")) {
+		if (argc != 5) {
+			usage(argv[0]);
+			return 2;
+		}
+		return client(argv[1], argv[2], argv[3], argv[4]) ? 1 : 0;
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	u32 nr_workers = cpus > 0 ? cpus : 1;
+	size_t cache_mb = 0;
+	int backend = EXT2_IO_PREAD;
+	int opt;
+	optind = 2;
+	while ((opt = getopt(argc, argv, "j:m:M")) != -1) {
+		switch (opt) {
+		case 'j': nr_workers = atoi(optarg); break;
+		case 'm': cache_mb = strtoul(optarg, NULL, 0); break;
+		case 'M': backend = EXT2_IO_MMAP; break;
+		default: usage(argv[0]); return 2;
+		}
+	}
+	if (argc - optind < 2 || !nr_workers || argc - optind - 1 > 0xffff) {
+		usage(argv[0]);
+		return 2;
+	}
+	u32 nr_images = argc - optind - 1;
+	size_t cache_size = cache_mb ? cache_mb << 20 : (size_t)nr_images * EXT2_CACHE_DEFAULT_SIZE;
+	if (serve(argv[optind], argv + optind + 1, nr_images, nr_workers, cache_size, backend)) {
+		fprintf(stderr, "Error: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
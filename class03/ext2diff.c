@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ext2.h"
+
+/*******************
+ * Difference of two ext2 images, usually two snapshots of one fs.
+ * Build: gcc -O2 -pthread -o ext2diff ext2diff.c ext2.c ext2_*.c
+ * Usage: ext2diff [-j threads] [-c] old_image new_image
+ *
+ * Both trees are walked in lockstep: a job takes a pair of directories, reads
+ * both, sorts entries by name and merges them. Names only in old are removed,
+ * names only in new are added, and directories there are not descended into.
+ * Names in both get their inodes compared:
+ * - other type, mode, uid or gid is a change right away;
+ * - same size, mtime and block pointers is no change and no data is read,
+ *   which is the common case between snapshots of one fs;
+ * - other size is a change without reading data;
+ * - only same size with other mtime or blocks needs data, such files become
+ *   jobs of their own and get compared chunk by chunk, holes both files share
+ *   are skipped through extent maps.
+ * Jobs go to one stack shared by a pool of threads, so data compares run in
+ * parallel with each other and with directory reads.
+ * -c reads data of every pair of files with same size, for images that don't
+ * come from one fs and share no block numbers.
+ * Output is sorted by path, one line each: "A path", "D path" or "M path",
+ * directories end with '/'.
+ * Exit code is 0 for same trees, 1 for differences, 2 for errors.
+ ******************/
+
+#define DIFF_CHUNK		(1 << 20) /* Bytes of each file compared at once */
+
+#define DIFF_JOB_DIR	0
+#define DIFF_JOB_DATA	1
+
+struct diff_job {
+	int type;
+	u32 old_ino;
+	u32 new_ino;
+	char *path;		/* "" for root, "/a/b" below it */
+};
+
+struct diff_change {
+	char kind;		/* 'A', 'D' or 'M' */
+	char *path;
+};
+
+struct diff {
+	const struct ext2 *old;
+	const struct ext2 *new;
+	int full;		/* -c, don't trust block pointers */
+	pthread_mutex_t lock;	/* Protects everything below */
+	pthread_cond_t cond;	/* Signaled on new job, end and error */
+	struct diff_job *jobs;
+	u32 nr_jobs, jobs_capacity;
+	u64 pending;		/* Jobs queued or running */
+	int err;		/* errno of first failure */
+	struct diff_change *changes;
+	size_t nr_changes, changes_capacity;
+};
+
+struct diff_worker {
+	struct diff *diff;
+	pthread_t thread;
+	u8 *buf[2];		/* DIFF_CHUNK of old and new file */
+};
+
+/*** Names of one directory ***/
+struct diff_entry {
+	const char *name;	/* In names of diff_dir, not NUL terminated */
+	size_t name_off;
+	u32 ino;
+	u8 name_len;
+	u8 file_type;
+};
+
+struct diff_dir {
+	struct diff_entry *entries;
+	u32 count, capacity;
+	char *names;
+	size_t names_len, names_size;
+};
+
+static int diff_push(struct diff *diff, int type, u32 old_ino, u32 new_ino, char *path) {
+	/*** Takes path, frees it on error ***/
+	pthread_mutex_lock(&diff->lock);
+	if (diff->nr_jobs == diff->jobs_capacity) {
+		u32 capacity = diff->jobs_capacity ? 2 * diff->jobs_capacity : 64;
+		struct diff_job *jobs = realloc(diff->jobs, capacity * sizeof(*jobs));
+		if (!jobs) {
+			pthread_mutex_unlock(&diff->lock);
+			free(path);
+			return -1;
+		}
+		diff->jobs = jobs;
+		diff->jobs_capacity = capacity;
+	}
+	diff->jobs[diff->nr_jobs++] = (struct diff_job){ type, old_ino, new_ino, path };
+	diff->pending++;
+	pthread_cond_signal(&diff->cond);
+	pthread_mutex_unlock(&diff->lock);
+	return 0;
+}
+
+static int diff_report(struct diff *diff, char kind, const char *path, int dir) {
+	char *copy = malloc(strlen(path) + 2);
+	if (!copy)
+		return -1;
+	strcpy(copy, path);
+	if (dir)
+		strcat(copy, "/");
+	pthread_mutex_lock(&diff->lock);
+	if (diff->nr_changes == diff->changes_capacity) {
+		size_t capacity = diff->changes_capacity ? 2 * diff->changes_capacity : 64;
+		struct diff_change *changes = realloc(diff->changes, capacity * sizeof(*changes));
+		if (!changes) {
+			pthread_mutex_unlock(&diff->lock);
+			free(copy);
+			return -1;
+		}
+		diff->changes = changes;
+		diff->changes_capacity = capacity;
+	}
+	diff->changes[diff->nr_changes++] = (struct diff_change){ kind, copy };
+	pthread_mutex_unlock(&diff->lock);
+	return 0;
+}
+
+static char *diff_child_path(const char *parent, const struct diff_entry *entry) {
+	size_t parent_len = strlen(parent);
+	char *path = malloc(parent_len + 1 + entry->name_len + 1);
+	if (!path)
+		return NULL;
+	memcpy(path, parent, parent_len);
+	path[parent_len] = '/';
+	memcpy(path + parent_len + 1, entry->name, entry->name_len);
+	path[parent_len + 1 + entry->name_len] = '\0';
+	return path;
+}
+
+/*** Directories ***/
+
+static int diff_entry_cmp(const void *a, const void *b) {
+	const struct diff_entry *x = a, *y = b;
+	int res = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+	if (res)
+		return res;
+	return (int)x->name_len - (int)y->name_len;
+}
+
+static int diff_dir_add(struct diff_dir *dir, const struct ext2_dirent *dirent) {
+	if (dir->count == dir->capacity) {
+		u32 capacity = dir->capacity ? 2 * dir->capacity : 64;
+		struct diff_entry *entries = realloc(dir->entries, capacity * sizeof(*entries));
+		if (!entries)
+			return -1;
+		dir->entries = entries;
+		dir->capacity = capacity;
+	}
+	if (dir->names_len + dirent->name_len > dir->names_size) {
+		size_t size = dir->names_size ? 2 * dir->names_size : 4096;
+		while (size < dir->names_len + dirent->name_len)
+			size *= 2;
+		char *names = realloc(dir->names, size);
+		if (!names)
+			return -1;
+		dir->names = names;
+		dir->names_size = size;
+	}
+	struct diff_entry *entry = &dir->entries[dir->count++];
+	entry->name_off = dir->names_len;
+	entry->ino = dirent->inode;
+	entry->name_len = dirent->name_len;
+	entry->file_type = dirent->file_type;
+	memcpy(dir->names + dir->names_len, dirent->name, dirent->name_len);
+	dir->names_len += dirent->name_len;
+	return 0;
+}
+
+static int diff_dir_read(struct diff_dir *dir, const struct ext2 *ext2, u32 ino) {
+	/*** Reads all entries but . and .. sorted by name, returns 0 or -1 and sets errno ***/
+	struct ext2_dir_iter iter;
+	struct ext2_dirent dirent;
+	int res = ext2_dir_iter_new(&iter, ext2, ino);
+	if (res)
+		goto out_diff_dir_read;
+	while ((res = ext2_dir_iter_next(&iter, &dirent)) > 0) {
+		if (dirent.name[0] == '.' && (dirent.name_len == 1 || (dirent.name_len == 2 && dirent.name[1] == '.')))
+			continue;
+		if (diff_dir_add(dir, &dirent)) {
+			res = -1;
+			break;
+		}
+	}
+out_diff_dir_read:
+	ext2_dir_iter_end(&iter);
+	if (res < 0)
+		return -1;
+	/*** Names buffer has moved while it grew ***/
+	for (u32 i = 0; i < dir->count; ++i)
+		dir->entries[i].name = dir->names + dir->entries[i].name_off;
+	qsort(dir->entries, dir->count, sizeof(*dir->entries), diff_entry_cmp);
+	return 0;
+}
+
+static void diff_dir_free(struct diff_dir *dir) {
+	free(dir->entries);
+	free(dir->names);
+}
+
+static int diff_entry_is_dir(const struct ext2 *ext2, const struct diff_entry *entry, int *dir) {
+	/*** Inode is read only without filetype feature ***/
+	if (entry->file_type != EXT2_FT_UNKNOWN) {
+		*dir = entry->file_type == EXT2_FT_DIR;
+		return 0;
+	}
+	struct ext2_inode inode;
+	if (read_inode(ext2, &inode, entry->ino))
+		return -1;
+	*dir = ISDIR(inode.i_mode);
+	return 0;
+}
+
+static int diff_one_side(struct diff *diff, const struct ext2 *ext2, char kind, const char *parent, const struct diff_entry *entry) {
+	int dir;
+	char *path = diff_child_path(parent, entry);
+	if (!path)
+		return -1;
+	int res = diff_entry_is_dir(ext2, entry, &dir);
+	if (!res)
+		res = diff_report(diff, kind, path, dir);
+	free(path);
+	return res;
+}
+
+/*** Inodes ***/
+
+static int fast_symlink(const struct ext2 *ext2, const struct ext2_inode *inode) {
+	/*** Target kept in i_block when no data block is allocated ***/
+	u32 acl_sectors = inode->i_file_acl ? ext2->blocksize / 512 : 0;
+	return ISLNK(inode->i_mode) && inode->i_blocks == acl_sectors;
+}
+
+static int diff_same_data(const struct ext2_inode *old, const struct ext2_inode *new) {
+	/*** Same blocks written at same time are taken as same contents ***/
+	return ext2_inode_size(old) == ext2_inode_size(new) && old->i_mtime == new->i_mtime &&
+		!memcmp(old->i_block, new->i_block, sizeof(old->i_block));
+}
+
+static int diff_pair(struct diff *diff, const char *parent, const struct diff_entry *old_entry, const struct diff_entry *new_entry) {
+	/*** Compares entry of both trees, data compare and subdirectory become jobs ***/
+	struct ext2_inode old, new;
+	if (read_inode(diff->old, &old, old_entry->ino) || read_inode(diff->new, &new, new_entry->ino))
+		return -1;
+	char *path = diff_child_path(parent, new_entry);
+	if (!path)
+		return -1;
+	u16 fmt = old.i_mode & EXT2_S_IFMT;
+	int res = 0;
+	if (fmt != (new.i_mode & EXT2_S_IFMT)) {
+		res = diff_report(diff, 'M', path, 0);
+		goto out_diff_pair;
+	}
+	int changed = old.i_mode != new.i_mode || old.i_uid != new.i_uid || old.i_gid != new.i_gid;
+	if (fmt == EXT2_S_ISDIR) {
+		if (changed && diff_report(diff, 'M', path, 1)) {
+			res = -1;
+			goto out_diff_pair;
+		}
+		res = diff_push(diff, DIFF_JOB_DIR, old_entry->ino, new_entry->ino, path);
+		return res;
+	}
+	if (!changed) {
+		if (fmt == EXT2_S_IFREG || (fmt == EXT2_S_IFLNK && !fast_symlink(diff->old, &old) && !fast_symlink(diff->new, &new))) {
+			if (!diff->full && diff_same_data(&old, &new))
+				goto out_diff_pair;
+			if (ext2_inode_size(&old) == ext2_inode_size(&new))
+				return diff_push(diff, DIFF_JOB_DATA, old_entry->ino, new_entry->ino, path);
+			changed = 1;
+		} else if (fmt == EXT2_S_IFLNK) {
+			/*** Fast symlink on either side, target is in i_block of both or sizes differ ***/
+			changed = old.i_size != new.i_size || !fast_symlink(diff->old, &old) || !fast_symlink(diff->new, &new) ||
+				old.i_size > sizeof(old.i_block) || memcmp(old.i_block, new.i_block, old.i_size);
+		} else {
+			/*** Devices keep numbers in i_block ***/
+			changed = memcmp(old.i_block, new.i_block, sizeof(old.i_block)) != 0;
+		}
+	}
+	if (changed)
+		res = diff_report(diff, 'M', path, 0);
+out_diff_pair:
+	free(path);
+	return res;
+}
+
+static int diff_dirs(struct diff *diff, const struct diff_job *job) {
+	/*** Returns 0, or -1 and sets errno ***/
+	struct diff_dir old, new;
+	memset(&old, 0, sizeof(old));
+	memset(&new, 0, sizeof(new));
+	int res = diff_dir_read(&old, diff->old, job->old_ino);
+	if (!res)
+		res = diff_dir_read(&new, diff->new, job->new_ino);
+	u32 i = 0, j = 0;
+	while (!res && (i < old.count || j < new.count)) {
+		int cmp = i == old.count ? 1 : j == new.count ? -1 : diff_entry_cmp(&old.entries[i], &new.entries[j]);
+		if (cmp < 0)
+			res = diff_one_side(diff, diff->old, 'D', job->path, &old.entries[i++]);
+		else if (cmp > 0)
+			res = diff_one_side(diff, diff->new, 'A', job->path, &new.entries[j++]);
+		else
+			res = diff_pair(diff, job->path, &old.entries[i++], &new.entries[j++]);
+		if (!res && __atomic_load_n(&diff->err, __ATOMIC_RELAXED))
+			break;
+	}
+	diff_dir_free(&old);
+	diff_dir_free(&new);
+	return res;
+}
+
+/*** Data ***/
+
+static int diff_skip_holes(struct ext2_inode_blocks_iter *old, struct ext2_inode_blocks_iter *new, u64 size) {
+	/*** Moves both to first data of either, range before it is zeros in both ***/
+	u64 next = size;
+	struct ext2_inode_blocks_iter *iters[2] = { old, new };
+	u64 offset = old->offset;
+	for (int i = 0; i < 2; ++i) {
+		off_t data = ext2_inode_blocks_iter_lseek(iters[i], offset, SEEK_DATA);
+		if (data < 0 && errno != ENXIO)
+			return -1;
+		if (data >= 0 && (u64)data < next)
+			next = data;
+	}
+	if (ext2_inode_blocks_iter_lseek(old, next, SEEK_SET) < 0 || ext2_inode_blocks_iter_lseek(new, next, SEEK_SET) < 0)
+		return -1;
+	return 0;
+}
+
+static ssize_t diff_fill(struct ext2_inode_blocks_iter *iter, u8 *buf, size_t len) {
+	/*** Reads len bytes unless file ends, across extents ***/
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = ext2_inode_blocks_iter_next_run(iter, buf + done, len - done);
+		if (n < 0)
+			return -1;
+		if (!n)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+static int diff_data(struct diff_worker *worker, const struct diff_job *job) {
+	/*** Returns 1 for different data, 0 for same, -1 and sets errno on error ***/
+	struct diff *diff = worker->diff;
+	struct ext2_inode_blocks_iter old, new;
+	int res = ext2_inode_blocks_iter_new(&old, diff->old, job->old_ino);
+	if (res)
+		return -1;
+	res = ext2_inode_blocks_iter_new(&new, diff->new, job->new_ino);
+	if (res) {
+		ext2_inode_blocks_iter_end(&old);
+		return -1;
+	}
+	u64 size = ext2_inode_size(&old.ino);
+	while (!res) {
+		if (diff_skip_holes(&old, &new, size)) {
+			res = -1;
+			break;
+		}
+		if (old.offset >= size)
+			break;
+		size_t len = size - old.offset < DIFF_CHUNK ? size - old.offset : DIFF_CHUNK;
+		ssize_t old_len = diff_fill(&old, worker->buf[0], len);
+		ssize_t new_len = diff_fill(&new, worker->buf[1], len);
+		if (old_len < 0 || new_len < 0)
+			res = -1;
+		else if (old_len != new_len || memcmp(worker->buf[0], worker->buf[1], old_len))
+			res = 1;
+		else if (!old_len)
+			break;
+	}
+	ext2_inode_blocks_iter_end(&old);
+	ext2_inode_blocks_iter_end(&new);
+	return res;
+}
+
+/*** Workers ***/
+
+static int diff_run_job(struct diff_worker *worker, const struct diff_job *job) {
+	struct diff *diff = worker->diff;
+	if (job->type == DIFF_JOB_DIR)
+		return diff_dirs(diff, job);
+	int res = diff_data(worker, job);
+	if (res > 0)
+		return diff_report(diff, 'M', job->path, 0);
+	return res;
+}
+
+static void *diff_worker(void *arg) {
+	struct diff_worker *worker = arg;
+	struct diff *diff = worker->diff;
+	pthread_mutex_lock(&diff->lock);
+	for (;;) {
+		while (!diff->nr_jobs && diff->pending && !diff->err)
+			pthread_cond_wait(&diff->cond, &diff->lock);
+		if (!diff->nr_jobs || diff->err)
+			break;
+		struct diff_job job = diff->jobs[--diff->nr_jobs];
+		pthread_mutex_unlock(&diff->lock);
+		int res = diff_run_job(worker, &job);
+		int err = errno;
+		free(job.path);
+		pthread_mutex_lock(&diff->lock);
+		if (res && !diff->err)
+			__atomic_store_n(&diff->err, err ? err : EIO, __ATOMIC_RELAXED);
+		/*** Jobs of this one are already counted, so zero means nothing is left ***/
+		if (!--diff->pending || diff->err)
+			pthread_cond_broadcast(&diff->cond);
+	}
+	pthread_mutex_unlock(&diff->lock);
+	return NULL;
+}
+
+static int diff_run(struct diff *diff, u32 nr_threads) {
+	/*** Returns 0, or -1 and sets errno ***/
+	struct diff_worker *workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers)
+		return -1;
+	char *root = strdup("");
+	int res = root ? diff_push(diff, DIFF_JOB_DIR, EXT2_ROOT_INO, EXT2_ROOT_INO, root) : -1;
+	u32 started = 0;
+	for (; !res && started < nr_threads; ++started) {
+		struct diff_worker *worker = &workers[started];
+		worker->diff = diff;
+		worker->buf[0] = malloc(DIFF_CHUNK);
+		worker->buf[1] = malloc(DIFF_CHUNK);
+		if (!worker->buf[0] || !worker->buf[1] || pthread_create(&worker->thread, NULL, diff_worker, worker)) {
+			free(worker->buf[0]);
+			free(worker->buf[1]);
+			break;
+		}
+	}
+	if (!res && !started) {
+		errno = EAGAIN;
+		res = -1;
+	}
+	for (u32 i = 0; i < started; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		free(workers[i].buf[0]);
+		free(workers[i].buf[1]);
+	}
+	free(workers);
+	/*** Left over jobs after an error ***/
+	for (u32 i = 0; i < diff->nr_jobs; ++i)
+		free(diff->jobs[i].path);
+	if (res)
+		return res;
+	if (diff->err) {
+		errno = diff->err;
+		return -1;
+	}
+	return 0;
+}
+
+static int diff_change_cmp(const void *a, const void *b) {
+	const struct diff_change *x = a, *y = b;
+	return strcmp(x->path, y->path);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-j threads] [-c] old_image new_image\n", name);
+}
+
+int main(int argc, char **argv) {
+	long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int full = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "j:c")) != -1) {
+		if (opt == 'j')
+			nr_threads = atol(optarg);
+		else if (opt == 'c')
+			full = 1;
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc - 2 || nr_threads < 1) {
+		usage(argv[0]);
+		return 2;
+	}
+	struct ext2 old, new;
+	if (ext2_open(&old, argv[optind])) {
+		printf("Error: %s: %s\n", argv[optind], strerror(errno));
+		return 2;
+	}
+	if (ext2_open(&new, argv[optind + 1])) {
+		printf("Error: %s: %s\n", argv[optind + 1], strerror(errno));
+		ext2_close(&old);
+		return 2;
+	}
+	struct diff diff;
+	memset(&diff, 0, sizeof(diff));
+	diff.old = &old;
+	diff.new = &new;
+	diff.full = full;
+	pthread_mutex_init(&diff.lock, NULL);
+	pthread_cond_init(&diff.cond, NULL);
+	int res = 2;
+	if (diff_run(&diff, nr_threads)) {
+		printf("Error: %s\n", strerror(errno));
+		goto out_main;
+	}
+	qsort(diff.changes, diff.nr_changes, sizeof(*diff.changes), diff_change_cmp);
+	for (size_t i = 0; i < diff.nr_changes; ++i)
+		printf("%c %s\n", diff.changes[i].kind, diff.changes[i].path);
+	res = diff.nr_changes ? 1 : 0;
+out_main:
+	for (size_t i = 0; i < diff.nr_changes; ++i)
+		free(diff.changes[i].path);
+	free(diff.changes);
+	free(diff.jobs);
+	pthread_cond_destroy(&diff.cond);
+	pthread_mutex_destroy(&diff.lock);
+	ext2_close(&old);
+	ext2_close(&new);
+	return res;
+}
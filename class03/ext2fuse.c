@@ -0,0 +1,517 @@
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 34
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+
+#include "ext2.h"
+
+/*******************
+ * Read-only FUSE mount of ext2 image, low-level API of libfuse 3.
+ * Build: gcc -O2 -pthread -o ext2fuse ext2fuse.c ext2.c ext2_*.c $(pkg-config --cflags --libs fuse3)
+ * Usage: ext2fuse [-o cache_mb=N,mmap,timeout=S] [fuse options] image mountpoint
+ *        fusermount3 -u mountpoint
+ *
+ * No root is needed, fusermount3 mounts for the user. Requests are dispatched
+ * by libfuse worker threads which all share one ext2, its block and dentry
+ * caches. Image never changes under the mount, so attributes, entries and
+ * file pages are cached by the kernel for a long time (timeout, default one
+ * hour) and kept across opens.
+ * readdirplus hands attributes out with entries, so ls -l takes no getattr
+ * per entry. Reads reply with the image fd and offsets of physical runs, so
+ * libfuse splices data from image page cache to /dev/fuse without copying it
+ * through user space, holes come from a zero buffer. max_read is 1 MiB.
+ * FUSE inode numbers are ext2 ones, except FUSE root 1 which is ext2 root 2.
+ ******************/
+
+#define FS_MAX_READ		(1 << 20)
+
+struct fs {
+	struct ext2 ext2;
+	double timeout;		/* Seconds kernel caches attributes and entries */
+};
+
+/*** Options after -o ***/
+struct fs_opts {
+	const char *image;
+	unsigned cache_mb;
+	int mmap;
+	double timeout;
+};
+
+/*** Open regular file, extent map is only read so threads share it ***/
+struct fs_file {
+	struct ext2_inode inode;
+	struct ext2_extent_map map;
+};
+
+static const char fs_zeros[FS_MAX_READ];
+
+/*** Directory entry file_type to mode, kernel takes d_type from it ***/
+static const mode_t fs_ftype_mode[EXT2_FT_MAX] = { 0, S_IFREG, S_IFDIR, S_IFCHR, S_IFBLK, S_IFIFO, S_IFSOCK, S_IFLNK };
+
+static struct fs *fs_get(fuse_req_t req) {
+	return fuse_req_userdata(req);
+}
+
+static u32 fs_ext2_ino(fuse_ino_t ino) {
+	return ino == FUSE_ROOT_ID ? EXT2_ROOT_INO : ino;
+}
+
+static fuse_ino_t fs_fuse_ino(u32 ino) {
+	return ino == EXT2_ROOT_INO ? FUSE_ROOT_ID : ino;
+}
+
+static int fs_errno(void) {
+	/*** Library errors as errno values kernel understands ***/
+	switch (errno) {
+	case ERR_FS_NOT_FOUND: return ENOENT;
+	case ERR_FS_NOT_DIR: return ENOTDIR;
+	case ERR_FS_CACHE_FULL: return EAGAIN;
+	case ERR_FS_NOT_EXT2:
+	case ERR_FS_INCOMPAT: return EINVAL;
+	case ERR_FS_IO:
+	case ERR_FS_CORRUPT: return EIO;
+	}
+	return errno > 0 ? errno : EIO;
+}
+
+static void fs_stat(const struct ext2 *ext2, u32 ino, const struct ext2_inode *inode, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_mode = inode->i_mode;
+	st->st_nlink = inode->i_links_count;
+	st->st_uid = inode->i_uid;
+	st->st_gid = inode->i_gid;
+	st->st_size = ext2_inode_size(inode);
+	st->st_blocks = inode->i_blocks;
+	st->st_blksize = ext2->blocksize;
+	st->st_atime = inode->i_atime;
+	st->st_mtime = inode->i_mtime;
+	st->st_ctime = inode->i_ctime;
+	u32 mode = inode->i_mode & EXT2_S_IFMT;
+	if (mode == EXT2_S_IFCHR || mode == EXT2_S_IFBLK) {
+		/*** Old encoding in i_block[0], new one in i_block[1] ***/
+		u32 dev = inode->i_block[0];
+		if (dev)
+			st->st_rdev = makedev((dev >> 8) & 0xff, dev & 0xff);
+		else
+			dev = inode->i_block[1], st->st_rdev = makedev((dev & 0xfff00) >> 8, (dev & 0xff) | ((dev >> 12) & 0xfff00));
+	}
+}
+
+static int fs_entry(struct fs *fs, u32 ino, struct fuse_entry_param *e) {
+	struct ext2_inode inode;
+	if (read_inode(&fs->ext2, &inode, ino))
+		return -1;
+	memset(e, 0, sizeof(*e));
+	e->ino = fs_fuse_ino(ino);
+	e->generation = inode.i_generation;
+	e->attr_timeout = fs->timeout;
+	e->entry_timeout = fs->timeout;
+	fs_stat(&fs->ext2, ino, &inode, &e->attr);
+	return 0;
+}
+
+static int fs_fast_symlink(const struct ext2 *ext2, const struct ext2_inode *inode) {
+	/*** Target kept in i_block when no data block is allocated ***/
+	u32 acl_sectors = inode->i_file_acl ? ext2->blocksize / 512 : 0;
+	return ISLNK(inode->i_mode) && inode->i_blocks == acl_sectors;
+}
+
+static void fs_init(void *userdata, struct fuse_conn_info *conn) {
+	(void)userdata;
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+		conn->want |= FUSE_CAP_SPLICE_MOVE;
+	/*** Every readdir is a readdirplus, not only the first one ***/
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+	conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+	conn->max_readahead = EXT2_RA_MAX_SIZE;
+}
+
+static void fs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	struct fs *fs = fs_get(req);
+	struct fuse_entry_param e;
+	int ino = ext2_lookup(&fs->ext2, fs_ext2_ino(parent), name, strlen(name));
+	if (ino < 0) {
+		fuse_reply_err(req, fs_errno());
+		return;
+	}
+	if (!ino) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (fs_entry(fs, ino, &e))
+		fuse_reply_err(req, fs_errno());
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void fs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+	/*** Nothing is kept per inode ***/
+	(void)ino, (void)nlookup;
+	fuse_reply_none(req);
+}
+
+static void fs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	(void)fi;
+	struct fs *fs = fs_get(req);
+	struct ext2_inode inode;
+	struct stat st;
+	if (read_inode(&fs->ext2, &inode, fs_ext2_ino(ino))) {
+		fuse_reply_err(req, fs_errno());
+		return;
+	}
+	fs_stat(&fs->ext2, fs_ext2_ino(ino), &inode, &st);
+	fuse_reply_attr(req, &st, fs->timeout);
+}
+
+static void fs_readlink(fuse_req_t req, fuse_ino_t ino) {
+	struct fs *fs = fs_get(req);
+	const struct ext2 *ext2 = &fs->ext2;
+	struct ext2_inode inode;
+	if (read_inode(ext2, &inode, fs_ext2_ino(ino))) {
+		fuse_reply_err(req, fs_errno());
+		return;
+	}
+	if (!ISLNK(inode.i_mode)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	int fast = fs_fast_symlink(ext2, &inode);
+	u32 len = inode.i_size;
+	if (fast ? len >= sizeof(inode.i_block) : len >= ext2->blocksize || !inode.i_block[0]) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	char target[EXT2_MAX_BLOCK_SIZE];
+	if (fast) {
+		memcpy(target, inode.i_block, len);
+	} else {
+		struct ext2_block *block = ext2_bread(ext2, inode.i_block[0]);
+		if (!block) {
+			fuse_reply_err(req, fs_errno());
+			return;
+		}
+		memcpy(target, block->data, len);
+		ext2_brelse(ext2, block);
+	}
+	target[len] = '\0';
+	fuse_reply_readlink(req, target);
+}
+
+static void fs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct fs *fs = fs_get(req);
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	struct fs_file *file = malloc(sizeof(*file));
+	if (!file) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	if (read_inode(&fs->ext2, &file->inode, fs_ext2_ino(ino)) || ext2_inode_extents(&fs->ext2, &file->inode, &file->map)) {
+		fuse_reply_err(req, fs_errno());
+		free(file);
+		return;
+	}
+	fi->fh = (uintptr_t)file;
+	fi->keep_cache = 1;
+	if (fuse_reply_open(req, fi)) { /*** Open was interrupted, no release comes ***/
+		ext2_extent_map_free(&file->map);
+		free(file);
+	}
+}
+
+static u32 fs_extent_index(const struct ext2_extent_map *map, u32 logical) {
+	/*** First extent that ends past logical, map->count if none ***/
+	u32 lo = 0, hi = map->count;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (map->extents[mid].logical + map->extents[mid].len <= logical)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void fs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	(void)ino;
+	struct fs *fs = fs_get(req);
+	const struct ext2 *ext2 = &fs->ext2;
+	const struct fs_file *file = (const struct fs_file *)(uintptr_t)fi->fh;
+	const struct ext2_extent_map *map = &file->map;
+	u64 file_size = ext2_inode_size(&file->inode);
+	u32 block_size = ext2->blocksize;
+	if (off < 0 || (u64)off >= file_size) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	if (size > FS_MAX_READ)
+		size = FS_MAX_READ;
+	if (size > file_size - off)
+		size = file_size - off;
+	/*** Buffer per extent in range and per gap before it, one more for hole past the map ***/
+	u64 end = off + size;
+	u32 i = fs_extent_index(map, off / block_size);
+	u32 last = fs_extent_index(map, (end - 1) / block_size);
+	size_t bytes = offsetof(struct fuse_bufvec, buf) + (2 * (size_t)(last - i + 1) + 1) * sizeof(struct fuse_buf);
+	struct fuse_bufvec *bufv = ext2_pool_alloc(bytes);
+	if (!bufv) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	memset(bufv, 0, bytes);
+	u64 pos = off;
+	while (pos < end) {
+		struct fuse_buf *buf = &bufv->buf[bufv->count++];
+		const struct ext2_extent *extent = i < map->count ? &map->extents[i] : NULL;
+		u64 extent_start = extent ? (u64)extent->logical * block_size : end;
+		u64 run_end;
+		if (pos < extent_start) { /*** Not mapped, reads as zeros ***/
+			run_end = extent_start < end ? extent_start : end;
+		} else {
+			u64 extent_end = extent_start + (u64)extent->len * block_size;
+			run_end = extent_end < end ? extent_end : end;
+			if (extent->physical) {
+				buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+				buf->fd = ext2->fd;
+				buf->pos = (u64)extent->physical * block_size + (pos - extent_start);
+			}
+			i++;
+		}
+		buf->size = run_end - pos;
+		if (!(buf->flags & FUSE_BUF_IS_FD))
+			buf->mem = (void *)fs_zeros;
+		pos = run_end;
+	}
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	ext2_pool_free(bufv);
+}
+
+static void fs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	(void)ino;
+	struct fs_file *file = (struct fs_file *)(uintptr_t)fi->fh;
+	ext2_extent_map_free(&file->map);
+	free(file);
+	fuse_reply_err(req, 0);
+}
+
+static void fs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct fs *fs = fs_get(req);
+	struct ext2_inode inode;
+	if (read_inode(&fs->ext2, &inode, fs_ext2_ino(ino))) {
+		fuse_reply_err(req, fs_errno());
+		return;
+	}
+	if (!ISDIR(inode.i_mode)) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	fi->keep_cache = 1;
+	fi->cache_readdir = 1;
+	fuse_reply_open(req, fi);
+}
+
+static void fs_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, int plus) {
+	/*** off is ext2_dir_iter_tell position of next entry ***/
+	struct fs *fs = fs_get(req);
+	struct ext2_dir_iter iter;
+	struct ext2_dirent dirent;
+	char name[EXT2_NAME_LEN + 1];
+	char *buf = ext2_pool_alloc(size);
+	size_t used = 0;
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int res = ext2_dir_iter_new(&iter, &fs->ext2, fs_ext2_ino(ino));
+	if (!res && off)
+		res = ext2_dir_iter_seek(&iter, off);
+	while (!res && (res = ext2_dir_iter_next(&iter, &dirent)) > 0) {
+		res = 0;
+		memcpy(name, dirent.name, dirent.name_len);
+		name[dirent.name_len] = '\0';
+		off_t next = ext2_dir_iter_tell(&iter);
+		size_t len;
+		if (plus) {
+			struct fuse_entry_param e;
+			int dot = !strcmp(name, ".") || !strcmp(name, "..");
+			if (dot) { /*** Kernel doesn't look these up ***/
+				memset(&e, 0, sizeof(e));
+				e.attr.st_ino = dirent.inode;
+				e.attr.st_mode = S_IFDIR;
+			} else if (fs_entry(fs, dirent.inode, &e)) {
+				res = -1;
+				break;
+			}
+			len = fuse_add_direntry_plus(req, buf + used, size - used, name, &e, next);
+		} else {
+			struct stat st;
+			memset(&st, 0, sizeof(st));
+			st.st_ino = dirent.inode;
+			st.st_mode = fs_ftype_mode[dirent.file_type];
+			len = fuse_add_direntry(req, buf + used, size - used, name, &st, next);
+		}
+		if (len > size - used) /*** Rest goes to next call ***/
+			break;
+		used += len;
+	}
+	ext2_dir_iter_end(&iter);
+	if (res < 0 && !used)
+		fuse_reply_err(req, fs_errno());
+	else
+		fuse_reply_buf(req, buf, used);
+	ext2_pool_free(buf);
+}
+
+static void fs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	(void)fi;
+	fs_do_readdir(req, ino, size, off, 0);
+}
+
+static void fs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	(void)fi;
+	fs_do_readdir(req, ino, size, off, 1);
+}
+
+static void fs_statfs(fuse_req_t req, fuse_ino_t ino) {
+	(void)ino;
+	const struct ext2 *ext2 = &fs_get(req)->ext2;
+	struct statvfs st;
+	memset(&st, 0, sizeof(st));
+	st.f_bsize = ext2->blocksize;
+	st.f_frsize = ext2->blocksize;
+	st.f_blocks = ext2->blocks_count - ext2->first_data_block;
+	st.f_bfree = ext2->free_blocks_count;
+	st.f_bavail = ext2->free_blocks_count;
+	st.f_files = ext2->inodes_count;
+	st.f_ffree = ext2->free_inodes_count;
+	st.f_favail = ext2->free_inodes_count;
+	st.f_flag = ST_RDONLY;
+	st.f_namemax = EXT2_NAME_LEN;
+	fuse_reply_statfs(req, &st);
+}
+
+static const struct fuse_lowlevel_ops fs_ops = {
+	.init = fs_init,
+	.lookup = fs_lookup,
+	.forget = fs_forget,
+	.getattr = fs_getattr,
+	.readlink = fs_readlink,
+	.open = fs_open,
+	.read = fs_read,
+	.release = fs_release,
+	.opendir = fs_opendir,
+	.readdir = fs_readdir,
+	.readdirplus = fs_readdirplus,
+	.statfs = fs_statfs,
+};
+
+#define FS_OPT(t, p) { t, offsetof(struct fs_opts, p), 1 }
+
+static const struct fuse_opt fs_opt_spec[] = {
+	FS_OPT("cache_mb=%u", cache_mb),
+	FS_OPT("mmap", mmap),
+	FS_OPT("timeout=%lf", timeout),
+	FUSE_OPT_END
+};
+
+static int fs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+	/*** First argument that is not an option is the image ***/
+	(void)outargs;
+	struct fs_opts *opts = data;
+	if (key == FUSE_OPT_KEY_NONOPT && !opts->image) {
+		opts->image = arg;
+		return 0;
+	}
+	return 1;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [options] image mountpoint\n"
+		"    -o cache_mb=N          block cache size in MiB\n"
+		"    -o mmap                map image instead of pread\n"
+		"    -o timeout=S           seconds kernel caches attributes (default 3600)\n", name);
+}
+
+int main(int argc, char **argv) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts cmdline;
+	struct fuse_loop_config config;
+	struct fuse_session *se = NULL;
+	struct fs fs;
+	struct fs_opts opts = { NULL, 0, 0, 3600 };
+	int res = 1;
+	int opened = 0;
+	if (fuse_opt_parse(&args, &opts, fs_opt_spec, fs_opt_proc))
+		return 1;
+	if (fuse_parse_cmdline(&args, &cmdline))
+		return 1;
+	if (cmdline.show_help || !opts.image || !cmdline.mountpoint) {
+		usage(argv[0]);
+		if (cmdline.show_help)
+			fuse_lowlevel_help();
+		res = cmdline.show_help ? 0 : 1;
+		goto out_main;
+	}
+	if (cmdline.show_version) {
+		fuse_lowlevel_version();
+		res = 0;
+		goto out_main;
+	}
+	struct ext2_opts ext2_opts = {
+		opts.cache_mb ? (size_t)opts.cache_mb << 20 : EXT2_CACHE_DEFAULT_SIZE,
+		opts.mmap ? EXT2_IO_MMAP : EXT2_IO_PREAD,
+		0,
+	};
+	if (ext2_open_opts(&fs.ext2, opts.image, &ext2_opts)) {
+		fprintf(stderr, "Error: %s: %s\n", opts.image, strerror(errno));
+		goto out_main;
+	}
+	opened = 1;
+	fs.timeout = opts.timeout;
+	/*** Image is never written, big reads go to kernel in one request ***/
+	if (fuse_opt_add_arg(&args, "-oro,default_permissions,max_read=1048576"))
+		goto out_main;
+	se = fuse_session_new(&args, &fs_ops, sizeof(fs_ops), &fs);
+	if (!se)
+		goto out_main;
+	if (fuse_set_signal_handlers(se))
+		goto out_session;
+	if (fuse_session_mount(se, cmdline.mountpoint))
+		goto out_signals;
+	fuse_daemonize(cmdline.foreground);
+	if (cmdline.singlethread) {
+		res = fuse_session_loop(se);
+	} else {
+		config.clone_fd = cmdline.clone_fd;
+		config.max_idle_threads = cmdline.max_idle_threads;
+		res = fuse_session_loop_mt(se, &config);
+	}
+	res = res ? 1 : 0;
+	fuse_session_unmount(se);
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_session:
+	fuse_session_destroy(se);
+out_main:
+	if (opened)
+		ext2_close(&fs.ext2);
+	free(cmdline.mountpoint);
+	fuse_opt_free_args(&args);
+	return res;
+}